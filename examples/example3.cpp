@@ -20,6 +20,7 @@ int main(int argc, char *argv[])
     qInfo() << "Numbers mode:" << ZeroStorageCaptcha::numbersOnlyMode();
     qInfo() << "Cache capacity:" << ZeroStorageCaptcha::cacheMaxCapacity();
     qInfo() << "Cache size:" << ZeroStorageCaptcha::cacheSize();
+    qInfo() << "Cache memory limit (0 - unlimited):" << ZeroStorageCaptcha::cacheMaxMemory();
     qInfo() << "Default difficulty:" << ZeroStorageCaptcha::defaultDifficulty();
     qInfo() << "Default answer length:" << ZeroStorageCaptcha::defaultAnswerLength();
 
@@ -32,6 +33,7 @@ int main(int argc, char *argv[])
     qInfo() << "";
     qInfo() << "Captcha generated and saved to c.png";
     qInfo() << "Cache size after generation:" << ZeroStorageCaptcha::cacheSize();
+    qInfo() << "Cache memory usage:" << ZeroStorageCaptcha::cacheMemoryUsage() << "bytes";
     qInfo() << "";
 
     qInfo() << "Token:" << c->token();
@@ -42,6 +44,7 @@ int main(int argc, char *argv[])
     qInfo() << "";
     qInfo() << "Captcha removed from cache at first successful validation";
     qInfo() << "Current cache size:" << ZeroStorageCaptcha::cacheSize();
+    qInfo() << "Used tokens memory usage:" << ZeroStorageCaptcha::usedTokensMemoryUsage() << "bytes";
     qInfo() << "";
     qInfo() << "Cached captcha will be reused after <=3 minutes, when is not answered and its token expires";
 
@@ -0,0 +1,117 @@
+// GPLv3 (c) acetone, 2023
+// Zero Storage Captcha example (render benchmark)
+
+#include "zerostoragecaptcha.h"
+
+#include <QApplication>
+#include <QElapsedTimer>
+#include <QBuffer>
+#include <QDebug>
+
+constexpr int RENDERS_PER_RUN = 500;
+
+static qint64 benchmark(int difficulty, bool fastOverlay)
+{
+    ZeroStorageCaptcha::setFastOverlayMode(fastOverlay);
+
+    ZeroStorageCaptcha c;
+    c.generateAnswer();
+    c.setDifficulty(difficulty);
+    c.render(); // warm up font and path caches
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < RENDERS_PER_RUN; ++i)
+    {
+        c.render();
+    }
+    return timer.nsecsElapsed();
+}
+
+static qint64 benchmarkSprites(int difficulty)
+{
+    ZeroStorageCaptchaService::GlyphLibrary::build(difficulty);
+
+    ZeroStorageCaptcha c;
+    c.generateAnswer();
+    c.setDifficulty(difficulty);
+    c.renderFromSprites();
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < RENDERS_PER_RUN; ++i)
+    {
+        c.renderFromSprites();
+    }
+    return timer.nsecsElapsed();
+}
+
+static void benchmarkPng(int difficulty)
+{
+    ZeroStorageCaptcha c;
+    c.generateAnswer();
+    c.setDifficulty(difficulty);
+    c.render();
+
+    QByteArray qtPng;
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < RENDERS_PER_RUN; ++i)
+    {
+        qtPng.clear();
+        QBuffer buff(&qtPng);
+        c.qimage().save(&buff, "PNG");
+    }
+    const qint64 qt = timer.nsecsElapsed();
+
+    QByteArray builtinPng;
+    ZeroStorageCaptchaService::PngEncoder::encode(c.qimage(), builtinPng);
+    builtinPng.reserve(builtinPng.capacity()); // encoder grew it to the worst case size, keep that
+    timer.restart();
+    for (int i = 0; i < RENDERS_PER_RUN; ++i)
+    {
+        builtinPng.resize(0); // unlike clear(), keeps the reserved capacity
+        ZeroStorageCaptchaService::PngEncoder::encode(c.qimage(), builtinPng);
+    }
+    const qint64 builtin = timer.nsecsElapsed();
+
+    qInfo().noquote() << "Difficulty" << difficulty
+                      << "| QImage::save:" << qt / RENDERS_PER_RUN / 1000 << "us," << qtPng.size() << "bytes"
+                      << "| PngEncoder:" << builtin / RENDERS_PER_RUN / 1000 << "us," << builtinPng.size() << "bytes"
+                      << "| speedup:" << QString::number(static_cast<double>(qt) / builtin, 'f', 2) + "x";
+}
+
+int main(int argc, char *argv[])
+{
+    // To start QApplication without X-server (non-GUI system) should use:
+    // "export QT_QPA_PLATFORM=offscreen" in plain shell
+    // or
+    // "Environment=QT_QPA_PLATFORM=offscreen" in systemd service ([Service] section)
+    QApplication a(argc, argv);
+
+    qInfo() << "Full render() time per captcha," << RENDERS_PER_RUN << "renders per run";
+
+    for (int difficulty = 0; difficulty <= 2; ++difficulty)
+    {
+        const qint64 painter = benchmark(difficulty, false);
+        const qint64 fast = benchmark(difficulty, true);
+        const qint64 sprites = benchmarkSprites(difficulty);
+
+        qInfo().noquote() << "Difficulty" << difficulty
+                          << "| QPainter overlay:" << painter / RENDERS_PER_RUN / 1000 << "us"
+                          << "| fast overlay:" << fast / RENDERS_PER_RUN / 1000 << "us"
+                          << "| speedup:" << QString::number(static_cast<double>(painter) / fast, 'f', 2) + "x"
+                          << "| sprite tier:" << sprites / RENDERS_PER_RUN / 1000 << "us"
+                          << "| speedup:" << QString::number(static_cast<double>(painter) / sprites, 'f', 2) + "x";
+    }
+
+    qInfo() << "";
+    qInfo() << "PNG encoding time and size per captcha";
+    ZeroStorageCaptcha::setFastOverlayMode(false);
+    for (int difficulty = 0; difficulty <= 2; ++difficulty)
+    {
+        benchmarkPng(difficulty);
+    }
+
+    return 0;
+}
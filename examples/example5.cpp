@@ -0,0 +1,111 @@
+// GPLv3 (c) acetone, 2023
+// Zero Storage Captcha example (golden image hashes for seeded render)
+
+// Build with -DZEROSTORAGECAPTCHA_DETERMINISTIC (library and this file).
+// Record hashes before an optimization of render():  ./example5 --write golden.txt
+// Verify output is identical after it:                ./example5 golden.txt
+// Hashes depend on Qt version and installed fonts, record them on the machine that verifies.
+
+#include "zerostoragecaptcha.h"
+
+#include <QApplication>
+#include <QCryptographicHash>
+#include <QFile>
+#include <QMap>
+#include <QDebug>
+
+#ifndef ZEROSTORAGECAPTCHA_DETERMINISTIC
+#error "example5 requires -DZEROSTORAGECAPTCHA_DETERMINISTIC"
+#endif
+
+constexpr quint32 SEEDS_COUNT = 64;
+
+static QByteArray pictureHash(const QImage& image)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    for (int y = 0; y < image.height(); ++y)
+    {
+        hash.addData(reinterpret_cast<const char*>(image.constScanLine(y)), image.width() * 4);
+    }
+    return hash.result().toHex();
+}
+
+static QMap<QString, QByteArray> renderAll()
+{
+    QMap<QString, QByteArray> result;
+
+    for (int overlay = 0; overlay <= 1; ++overlay)
+    {
+        ZeroStorageCaptcha::setFastOverlayMode(overlay == 1);
+        for (int difficulty = 0; difficulty <= 2; ++difficulty)
+        {
+            for (quint32 seed = 1; seed <= SEEDS_COUNT; ++seed)
+            {
+                ZeroStorageCaptchaService::setSeed(seed);
+
+                ZeroStorageCaptcha c;
+                c.generateAnswer();
+                c.setDifficulty(difficulty);
+                c.render();
+
+                const QString key = QString("%1 %2 %3 %4").arg(overlay ? "fast" : "painter").arg(difficulty).arg(seed).arg(c.answer());
+                result[key] = pictureHash(c.qimage());
+            }
+        }
+    }
+
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    // To start QApplication without X-server (non-GUI system) should use:
+    // "export QT_QPA_PLATFORM=offscreen" in plain shell
+    // or
+    // "Environment=QT_QPA_PLATFORM=offscreen" in systemd service ([Service] section)
+    QApplication a(argc, argv);
+
+    const QStringList args = a.arguments();
+    const bool write = args.size() == 3 and args.at(1) == "--write";
+    if (args.size() != 2 and not write)
+    {
+        qInfo().noquote() << "Usage:" << args.first() << "[--write] <golden file>";
+        return 1;
+    }
+
+    const QMap<QString, QByteArray> current = renderAll();
+
+    QFile golden(args.last());
+    if (write)
+    {
+        if (not golden.open(QIODevice::WriteOnly)) return 1;
+        for (auto iter = current.constBegin(); iter != current.constEnd(); iter++)
+        {
+            golden.write(iter.key().toUtf8() + " " + iter.value() + "\n");
+        }
+        qInfo() << current.size() << "hashes written to" << golden.fileName();
+        return 0;
+    }
+
+    if (not golden.open(QIODevice::ReadOnly)) return 1;
+    int mismatches = 0;
+    int checked = 0;
+    while (not golden.atEnd())
+    {
+        const QByteArray line = golden.readLine().trimmed();
+        const int split = line.lastIndexOf(' ');
+        if (split < 0) continue;
+
+        const QString key = QString::fromUtf8(line.left(split));
+        const QByteArray expected = line.mid(split + 1);
+        ++checked;
+        if (current.value(key) != expected)
+        {
+            ++mismatches;
+            qInfo().noquote() << "MISMATCH" << key;
+        }
+    }
+
+    qInfo() << checked << "checked," << mismatches << "mismatches";
+    return mismatches == 0 and checked == current.size() ? 0 : 1;
+}
@@ -0,0 +1,679 @@
+// GPLv3 (c) acetone, 2023
+// Zero Storage Captcha HTTP service (Linux)
+
+// One epoll event loop per core, each with its own SO_REUSEPORT listening socket.
+// Cached PNG and JSON payloads are sent with writev() straight from the cache (no copies).
+// Each loop holds at most MAX_CONNECTIONS_PER_REACTOR connections and closes them after IDLE_TIMEOUT
+// without traffic; running out of descriptors drops pending connections instead of spinning.
+//
+// GET /captcha                      PNG picture, token in "X-Captcha-Token" header
+// GET /captcha.json                 {"image":"data:image/png;base64,...","token":"..."}
+// GET /validate?answer=...&token=.. {"valid":true} or {"valid":false}
+//
+// Self benchmark on localhost: zerostoragecaptcha-server --bench 10
+// Build: link with zerostoragecaptcha.cpp and Qt Gui, -pthread
+
+#include "../zerostoragecaptcha.h"
+
+#include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+namespace {
+
+constexpr int MAX_EVENTS = 256;
+constexpr int MAX_REQUEST_HEADER = 16 * 1024;
+constexpr int MAX_IOVEC = 64;
+constexpr int MAX_INPUT = 4 * MAX_REQUEST_HEADER; // unread requests stay in the socket buffer
+constexpr size_t MAX_QUEUED_PARTS = MAX_IOVEC;    // 10-32 pipelined responses
+constexpr int EPOLL_TIMEOUT_MSECS = 100;
+constexpr size_t MAX_CONNECTIONS_PER_REACTOR = 4096; // accepted and closed at once above it
+constexpr auto IDLE_TIMEOUT = std::chrono::seconds(30);  // no bytes read or written
+constexpr auto IDLE_SWEEP_INTERVAL = std::chrono::seconds(1);
+
+std::atomic<bool> stopped {false};
+
+struct Connection
+{
+    QByteArray input;
+    std::vector<QByteArray> output; // implicitly shared with cache, no copy
+    size_t outputIndex = 0;
+    qsizetype outputOffset = 0;
+    bool closeAfterWrite = false;
+    bool waitsWritable = false;
+    std::chrono::steady_clock::time_point lastActivity = std::chrono::steady_clock::now();
+};
+
+QByteArray queryValue(const QByteArray& query, const QByteArray& name)
+{
+    for (const QByteArray& pair: query.split('&'))
+    {
+        const int eq = pair.indexOf('=');
+        if (eq > 0 and pair.left(eq) == name)
+        {
+            QByteArray value = pair.mid(eq + 1);
+            value.replace('+', ' ');
+            return QByteArray::fromPercentEncoding(value);
+        }
+    }
+    return QByteArray();
+}
+
+QByteArray header(const char* status, const char* contentType, qsizetype contentLength, const QByteArray& extra = QByteArray())
+{
+    QByteArray result;
+    result.reserve(160 + extra.size());
+    result.append("HTTP/1.1 ").append(status)
+          .append("\r\nContent-Type: ").append(contentType)
+          .append("\r\nContent-Length: ").append(QByteArray::number(contentLength))
+          .append("\r\nCache-Control: no-store\r\n")
+          .append(extra)
+          .append("\r\n");
+    return result;
+}
+
+// Render budget is exhausted and the cache has nothing to recycle
+void serviceUnavailable(Connection& connection)
+{
+    static const QByteArray body = "render budget exhausted\n";
+    connection.output.push_back(header("503 Service Unavailable", "text/plain", body.size(), "Retry-After: 1\r\n"));
+    connection.output.push_back(body);
+}
+
+void handleRequest(Connection& connection, const QByteArray& method, const QByteArray& target)
+{
+    const int question = target.indexOf('?');
+    const QByteArray path = question < 0 ? target : target.left(question);
+    const QByteArray query = question < 0 ? QByteArray() : target.mid(question + 1);
+
+    if (method != "GET")
+    {
+        static const QByteArray body = "method not allowed\n";
+        connection.output.push_back(header("405 Method Not Allowed", "text/plain", body.size()));
+        connection.output.push_back(body);
+        return;
+    }
+
+    if (path == "/captcha")
+    {
+        const auto captcha = ZeroStorageCaptcha::cached();
+        if (captcha.isNull())
+        {
+            serviceUnavailable(connection);
+            return;
+        }
+        const QByteArray png = captcha->picturePng();
+        connection.output.push_back(header("200 OK", "image/png", png.size(), "X-Captcha-Token: " + captcha->token().toLatin1() + "\r\n"));
+        connection.output.push_back(png);
+    }
+    else if (path == "/captcha.json")
+    {
+        const auto captcha = ZeroStorageCaptcha::cached();
+        if (captcha.isNull())
+        {
+            serviceUnavailable(connection);
+            return;
+        }
+        const ZeroStorageCaptcha::JsonPayload payload = captcha->jsonPayload();
+        const QByteArray token = captcha->token().toLatin1();
+        connection.output.push_back(header("200 OK", "application/json", payload.size() + token.size()));
+        connection.output.push_back(payload.prefix);
+        connection.output.push_back(payload.dataUri);
+        connection.output.push_back(payload.middle);
+        connection.output.push_back(token);
+        connection.output.push_back(payload.tail);
+    }
+    else if (path == "/validate")
+    {
+        static const QByteArray valid = "{\"valid\":true}";
+        static const QByteArray invalid = "{\"valid\":false}";
+        const bool result = ZeroStorageCaptcha::validate(QString::fromUtf8(queryValue(query, "answer")),
+                                                         QString::fromLatin1(queryValue(query, "token")));
+        const QByteArray& body = result ? valid : invalid;
+        connection.output.push_back(header("200 OK", "application/json", body.size()));
+        connection.output.push_back(body);
+    }
+    else
+    {
+        static const QByteArray body = "not found\n";
+        connection.output.push_back(header("404 Not Found", "text/plain", body.size()));
+        connection.output.push_back(body);
+    }
+}
+
+// Returns false on malformed input (connection is closed).
+// Stops when responses queue is full: pipelined requests wait until the peer reads responses.
+bool parseRequests(Connection& connection)
+{
+    while (connection.output.size() - connection.outputIndex < MAX_QUEUED_PARTS)
+    {
+        const int end = connection.input.indexOf("\r\n\r\n");
+        if (end < 0)
+        {
+            return connection.input.size() <= MAX_REQUEST_HEADER;
+        }
+
+        const QByteArray head = connection.input.left(end);
+        const int lineEnd = head.indexOf("\r\n");
+        const QList<QByteArray> requestLine = (lineEnd < 0 ? head : head.left(lineEnd)).split(' ');
+        if (requestLine.size() != 3)
+        {
+            return false;
+        }
+
+        qsizetype bodyLength = 0;
+        const QByteArray lowerHead = head.toLower();
+        const int contentLength = lowerHead.indexOf("\r\ncontent-length:");
+        if (contentLength >= 0)
+        {
+            const int valueEnd = lowerHead.indexOf("\r\n", contentLength + 2);
+            bodyLength = lowerHead.mid(contentLength + 17, valueEnd < 0 ? -1 : valueEnd - contentLength - 17).trimmed().toLongLong();
+            if (bodyLength < 0 or bodyLength > MAX_REQUEST_HEADER)
+            {
+                return false;
+            }
+        }
+        if (connection.input.size() < end + 4 + bodyLength)
+        {
+            return true; // wait for body, it is ignored
+        }
+
+        if (requestLine.at(2) == "HTTP/1.0" ? not lowerHead.contains("\r\nconnection: keep-alive")
+                                            : lowerHead.contains("\r\nconnection: close"))
+        {
+            connection.closeAfterWrite = true;
+        }
+
+        handleRequest(connection, requestLine.at(0), requestLine.at(1));
+        connection.input.remove(0, end + 4 + bodyLength);
+
+        if (connection.closeAfterWrite)
+        {
+            connection.input.clear();
+            return true;
+        }
+    }
+    return true;
+}
+
+// Returns false when connection must be closed
+bool flush(int fd, Connection& connection)
+{
+    while (connection.outputIndex < connection.output.size())
+    {
+        iovec iov[MAX_IOVEC];
+        int count = 0;
+        for (size_t i = connection.outputIndex; i < connection.output.size() and count < MAX_IOVEC; ++i, ++count)
+        {
+            const qsizetype offset = i == connection.outputIndex ? connection.outputOffset : 0;
+            iov[count].iov_base = const_cast<char*>(connection.output[i].constData() + offset);
+            iov[count].iov_len = static_cast<size_t>(connection.output[i].size() - offset);
+        }
+
+        ssize_t written = ::writev(fd, iov, count);
+        if (written < 0)
+        {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN or errno == EWOULDBLOCK;
+        }
+        connection.lastActivity = std::chrono::steady_clock::now();
+
+        while (written > 0)
+        {
+            const qsizetype left = connection.output[connection.outputIndex].size() - connection.outputOffset;
+            if (written >= left)
+            {
+                written -= left;
+                connection.outputOffset = 0;
+                ++connection.outputIndex;
+            }
+            else
+            {
+                connection.outputOffset += written;
+                written = 0;
+            }
+        }
+    }
+
+    connection.output.clear();
+    connection.outputIndex = 0;
+    connection.outputOffset = 0;
+    return not connection.closeAfterWrite;
+}
+
+int listenSocket(const QByteArray& address, quint16 port)
+{
+    const int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    int on = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+    sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (::inet_pton(AF_INET, address.constData(), &addr.sin_addr) != 1 or
+        ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 or
+        ::listen(fd, SOMAXCONN) != 0)
+    {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void reactor(int listenFd)
+{
+    const int epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+    std::unordered_map<int, Connection> connections;
+
+    // Reserve descriptor for EMFILE/ENFILE: the listening socket is level-triggered,
+    // so a pending connection that cannot be accepted would wake the loop forever.
+    // It is released to accept and drop that connection, then taken again; without it
+    // (another thread took the descriptor) the listening socket is paused until the next sweep.
+    int spareFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    bool listenPaused = false;
+
+    epoll_event listenEvent {};
+    listenEvent.events = EPOLLIN;
+    listenEvent.data.fd = listenFd;
+    ::epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &listenEvent);
+
+    auto closeConnection = [&](int fd) {
+        ::epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        ::close(fd);
+        connections.erase(fd);
+    };
+
+    // Backpressure: while the peer does not read responses, its socket is not read either,
+    // so requests stay in kernel buffers and TCP flow control slows the peer down
+    auto watchWritable = [&](int fd, Connection& connection, bool enabled) {
+        if (connection.waitsWritable == enabled) return;
+        connection.waitsWritable = enabled;
+        epoll_event event {};
+        event.events = enabled ? EPOLLOUT : EPOLLIN | EPOLLRDHUP;
+        event.data.fd = fd;
+        ::epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event);
+    };
+
+    // Idle connections (slow or silent peers, peers not reading responses) are closed
+    auto closeIdle = [&]() {
+        const auto deadline = std::chrono::steady_clock::now() - IDLE_TIMEOUT;
+        std::vector<int> idle;
+        for (const auto& connection: connections)
+        {
+            if (connection.second.lastActivity < deadline) idle.push_back(connection.first);
+        }
+        for (int fd: idle)
+        {
+            closeConnection(fd);
+        }
+    };
+
+    auto acceptConnections = [&]() {
+        while (true)
+        {
+            const int client = ::accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client < 0)
+            {
+                if (errno == EINTR or errno == ECONNABORTED) continue;
+                if ((errno == EMFILE or errno == ENFILE) and spareFd >= 0)
+                {
+                    ::close(spareFd);
+                    const int dropped = ::accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+                    if (dropped >= 0) ::close(dropped);
+                    spareFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+                    if (dropped >= 0) continue;
+                }
+                if (errno == EMFILE or errno == ENFILE)
+                {
+                    ::epoll_ctl(epollFd, EPOLL_CTL_DEL, listenFd, nullptr);
+                    listenPaused = true;
+                }
+                return;
+            }
+
+            if (connections.size() >= MAX_CONNECTIONS_PER_REACTOR)
+            {
+                ::close(client);
+                continue;
+            }
+
+            int on = 1;
+            ::setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            epoll_event event {};
+            event.events = EPOLLIN | EPOLLRDHUP;
+            event.data.fd = client;
+            ::epoll_ctl(epollFd, EPOLL_CTL_ADD, client, &event);
+            connections.emplace(client, Connection());
+        }
+    };
+
+    epoll_event events[MAX_EVENTS];
+    char buffer[16 * 1024];
+    auto nextIdleSweep = std::chrono::steady_clock::now() + IDLE_SWEEP_INTERVAL;
+
+    while (not stopped)
+    {
+        const int count = ::epoll_wait(epollFd, events, MAX_EVENTS, EPOLL_TIMEOUT_MSECS);
+        for (int i = 0; i < count; ++i)
+        {
+            const int fd = events[i].data.fd;
+
+            if (fd == listenFd)
+            {
+                acceptConnections();
+                continue;
+            }
+
+            auto iter = connections.find(fd);
+            if (iter == connections.end()) continue;
+            Connection& connection = iter->second;
+
+            bool peerClosed = (events[i].events & (EPOLLHUP | EPOLLERR)) != 0;
+            if (not connection.waitsWritable and events[i].events & (EPOLLIN | EPOLLRDHUP))
+            {
+                while (connection.input.size() < MAX_INPUT)
+                {
+                    const ssize_t received = ::recv(fd, buffer, sizeof(buffer), 0);
+                    if (received > 0)
+                    {
+                        connection.input.append(buffer, static_cast<int>(received));
+                        connection.lastActivity = std::chrono::steady_clock::now();
+                        continue;
+                    }
+                    if (received < 0 and errno == EINTR) continue;
+                    peerClosed = received == 0 or (errno != EAGAIN and errno != EWOULDBLOCK);
+                    break;
+                }
+            }
+
+            // Parse and flush in turns while the peer takes responses
+            bool closed = false;
+            while (true)
+            {
+                if (not connection.closeAfterWrite and not parseRequests(connection))
+                {
+                    closed = true;
+                    break;
+                }
+                if (connection.output.empty())
+                {
+                    break;
+                }
+                if (not flush(fd, connection))
+                {
+                    closed = true;
+                    break;
+                }
+                if (not connection.output.empty())
+                {
+                    break; // socket buffer is full
+                }
+            }
+
+            if (closed or (peerClosed and connection.output.empty()))
+            {
+                closeConnection(fd);
+                continue;
+            }
+            watchWritable(fd, connection, not connection.output.empty());
+        }
+
+        if (std::chrono::steady_clock::now() >= nextIdleSweep)
+        {
+            closeIdle();
+            if (listenPaused)
+            {
+                if (spareFd < 0) spareFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+                listenPaused = ::epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &listenEvent) != 0;
+            }
+            nextIdleSweep = std::chrono::steady_clock::now() + IDLE_SWEEP_INTERVAL;
+        }
+    }
+
+    for (auto& connection: connections)
+    {
+        ::close(connection.first);
+    }
+    if (spareFd >= 0) ::close(spareFd);
+    ::close(epollFd);
+    ::close(listenFd);
+}
+
+//////////////////////////
+// Localhost benchmark
+
+struct BenchResult
+{
+    std::vector<qint64> issueNsecs;
+    std::vector<qint64> validateNsecs;
+    qint64 errors = 0;
+};
+
+// Blocking keep-alive request; returns response headers (lowercase) and body
+bool request(int fd, const QByteArray& target, QByteArray& headers, QByteArray& body)
+{
+    const QByteArray data = "GET " + target + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    if (::send(fd, data.constData(), static_cast<size_t>(data.size()), MSG_NOSIGNAL) != data.size()) return false;
+
+    QByteArray input;
+    char buffer[16 * 1024];
+    int end = -1;
+    qsizetype length = -1;
+    while (length < 0 or input.size() < end + 4 + length)
+    {
+        const ssize_t received = ::recv(fd, buffer, sizeof(buffer), 0);
+        if (received <= 0) return false;
+        input.append(buffer, static_cast<int>(received));
+
+        if (end < 0 and (end = input.indexOf("\r\n\r\n")) >= 0)
+        {
+            headers = input.left(end).toLower();
+            const int contentLength = headers.indexOf("\r\ncontent-length:");
+            if (contentLength < 0) return false;
+            const int valueEnd = headers.indexOf("\r\n", contentLength + 2);
+            length = headers.mid(contentLength + 17, valueEnd < 0 ? -1 : valueEnd - contentLength - 17).trimmed().toLongLong();
+        }
+    }
+    body = input.mid(end + 4, length);
+    return headers.startsWith("http/1.1 200");
+}
+
+void benchClient(quint16 port, std::chrono::steady_clock::time_point until, BenchResult& result)
+{
+    const int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int on = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+    {
+        ++result.errors;
+        ::close(fd);
+        return;
+    }
+
+    QByteArray headers;
+    QByteArray body;
+    while (std::chrono::steady_clock::now() < until)
+    {
+        auto start = std::chrono::steady_clock::now();
+        if (not request(fd, "/captcha", headers, body))
+        {
+            ++result.errors;
+            break;
+        }
+        result.issueNsecs.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+
+        const int tokenHeader = headers.indexOf("\r\nx-captcha-token:");
+        const int tokenEnd = headers.indexOf("\r\n", tokenHeader + 2);
+        const QByteArray token = headers.mid(tokenHeader + 18, tokenEnd < 0 ? -1 : tokenEnd - tokenHeader - 18).trimmed();
+
+        // Wrong answer: full token check without removing captcha from the cache
+        start = std::chrono::steady_clock::now();
+        if (not request(fd, "/validate?answer=-&token=" + token, headers, body))
+        {
+            ++result.errors;
+            break;
+        }
+        result.validateNsecs.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+    ::close(fd);
+}
+
+void report(const char* name, std::vector<qint64>& nsecs, double seconds)
+{
+    if (nsecs.empty())
+    {
+        qInfo().noquote() << name << "no requests";
+        return;
+    }
+    std::sort(nsecs.begin(), nsecs.end());
+    const auto percentile = [&](double p) { return nsecs[static_cast<size_t>(p * (nsecs.size() - 1))] / 1000.0; };
+    qInfo().noquote() << name
+                      << QString::number(nsecs.size() / seconds, 'f', 0) << "req/s"
+                      << "| p50" << QString::number(percentile(0.50), 'f', 1) << "us"
+                      << "| p99" << QString::number(percentile(0.99), 'f', 1) << "us";
+}
+
+void bench(quint16 port, int clients, int seconds)
+{
+    // Warm up: fill the cache before measuring
+    BenchResult warmup;
+    benchClient(port, std::chrono::steady_clock::now() + std::chrono::seconds(1), warmup);
+
+    std::vector<BenchResult> results(static_cast<size_t>(clients));
+    std::vector<std::thread> threads;
+    const auto until = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+    for (int i = 0; i < clients; ++i)
+    {
+        threads.emplace_back(benchClient, port, until, std::ref(results[static_cast<size_t>(i)]));
+    }
+    for (auto& thread: threads)
+    {
+        thread.join();
+    }
+
+    BenchResult total;
+    for (auto& result: results)
+    {
+        total.issueNsecs.insert(total.issueNsecs.end(), result.issueNsecs.begin(), result.issueNsecs.end());
+        total.validateNsecs.insert(total.validateNsecs.end(), result.validateNsecs.begin(), result.validateNsecs.end());
+        total.errors += result.errors;
+    }
+
+    qInfo() << "Benchmark:" << clients << "keep-alive connections," << seconds << "seconds";
+    report("issue   ", total.issueNsecs, seconds);
+    report("validate", total.validateNsecs, seconds);
+    qInfo() << "Errors:" << total.errors << "| cache size:" << ZeroStorageCaptcha::cacheSize()
+            << "| cache memory:" << ZeroStorageCaptcha::cacheMemoryUsage() << "bytes";
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+    {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QGuiApplication a(argc, argv);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Zero Storage Captcha HTTP service");
+    parser.addHelpOption();
+    parser.addOptions({
+        {"address", "Listening IPv4 address.", "address", "127.0.0.1"},
+        {"port", "Listening port.", "port", "8080"},
+        {"threads", "Event loops (0 - one per core).", "count", "0"},
+        {"difficulty", "Captcha difficulty (0-2).", "level", QString::number(ZeroStorageCaptcha::defaultDifficulty())},
+        {"cache", "Cache capacity (captchas).", "count", QString::number(ZeroStorageCaptcha::cacheMaxCapacity())},
+        {"render-budget", "Renders per second, 0 - unlimited.", "rps", "0"},
+        {"huge-pages", "Back picture slab arena with huge pages."},
+        {"sprites", "Compose captchas from glyph library when render budget is exhausted."},
+        {"compose-budget", "Sprite compositions per second, 0 - unlimited.", "rps", QString::number(ZeroStorageCaptchaService::Cache::composeBudget())},
+        {"bench", "Run localhost benchmark for N seconds and exit.", "seconds", "0"},
+        {"bench-clients", "Benchmark connections.", "count", "16"},
+    });
+    parser.process(a);
+
+    const quint16 port = static_cast<quint16>(parser.value("port").toUInt());
+    int threads = parser.value("threads").toInt();
+    if (threads <= 0)
+    {
+        threads = qMax(1, static_cast<int>(std::thread::hardware_concurrency()));
+    }
+
+    ZeroStorageCaptcha::setDefaultDifficulty(parser.value("difficulty").toInt());
+    ZeroStorageCaptcha::setCacheMaxCapacity(parser.value("cache").toLongLong());
+    ZeroStorageCaptcha::setCacheRenderBudget(parser.value("render-budget").toDouble());
+    ZeroStorageCaptcha::setCachePayloads(true);
+    ZeroStorageCaptcha::setFastOverlayMode(true);
+    ZeroStorageCaptcha::setBuiltinPngEncoder(true);
+    ZeroStorageCaptcha::setImageArena(true, parser.isSet("huge-pages"));
+    ZeroStorageCaptchaService::TimeToken::init(); // QTimer must live in the thread with event loop
+    ZeroStorageCaptcha::setSpriteTier(parser.isSet("sprites"), 16, parser.value("compose-budget").toDouble());
+
+    std::vector<std::thread> reactors;
+    for (int i = 0; i < threads; ++i)
+    {
+        const int fd = listenSocket(parser.value("address").toLatin1(), port);
+        if (fd < 0)
+        {
+            qCritical().noquote() << "Can't listen" << parser.value("address") + ":" + QString::number(port) << strerror(errno);
+            stopped = true;
+            break;
+        }
+        reactors.emplace_back(reactor, fd);
+    }
+
+    int result = 1;
+    if (not stopped)
+    {
+        qInfo().noquote() << "Listening" << parser.value("address") + ":" + QString::number(port) << "with" << threads << "event loops";
+
+        std::thread benchThread;
+        const int benchSeconds = parser.value("bench").toInt();
+        if (benchSeconds > 0)
+        {
+            benchThread = std::thread([&]() {
+                bench(port, parser.value("bench-clients").toInt(), benchSeconds);
+                QMetaObject::invokeMethod(&a, "quit", Qt::QueuedConnection);
+            });
+        }
+
+        result = a.exec();
+        if (benchThread.joinable()) benchThread.join();
+    }
+
+    stopped = true;
+    for (auto& thread: reactors)
+    {
+        thread.join();
+    }
+    return result;
+}
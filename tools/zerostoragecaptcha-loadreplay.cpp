@@ -0,0 +1,506 @@
+// GPLv3 (c) acetone, 2023
+// Zero Storage Captcha load replay: mixed legitimate and attack traffic
+
+// In-process mode (default) drives Cache::get(), Cache::remove() and TokenManager::validateAnswer()
+// on a simulated clock: time token rotation and render budget follow simulated time, so hours of
+// traffic with many TIMER_TO_CHANGE_TOKEN_MSECS boundaries run in minutes.
+//
+// Service mode (--service host:port) sends the same profiles to zerostoragecaptcha-server in real time.
+// Answers are not known there, so legitimate solves and previous window tokens are validated with
+// the wrong answer, only load and latency are meaningful.
+//
+// Build: link with zerostoragecaptcha.cpp and Qt Gui
+
+#include "../zerostoragecaptcha.h"
+
+#include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QThread>
+#include <QScopedPointer>
+#include <QFile>
+#include <QDebug>
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <ctime>
+
+namespace {
+
+enum Operation { Issue, Validate, OperationsCount };
+
+struct Profile
+{
+    qreal floodRps = 100;  // issue only
+    qreal wrongRps = 20;   // issue + wrong answer
+    qreal replayRps = 5;   // already solved token again
+    qreal staleRps = 2;    // solve of token issued in the previous time window
+    qreal legitRps = 10;   // issue + answer after think time
+    qreal solveRate = 0.9; // share of legitimate answers that are correct
+    qint64 thinkMsecs = 8000;
+};
+
+struct Issued
+{
+    QString answer;
+    QString token;
+    qint64 atMsecs;
+    bool correct;
+};
+
+struct Counters
+{
+    qint64 issued = 0;
+    qint64 validations = 0;
+    qint64 accepted = 0;
+    qint64 replaysAccepted = 0; // must stay 0
+    qint64 legitAccepted = 0;
+    qint64 legitAttempts = 0;
+    qint64 staleAccepted = 0;
+    qint64 staleAttempts = 0;
+};
+
+qint64 residentBytes()
+{
+    QFile statm("/proc/self/statm");
+    if (not statm.open(QIODevice::ReadOnly)) return 0;
+    const QList<QByteArray> fields = statm.readAll().split(' ');
+    return fields.size() > 1 ? fields.at(1).toLongLong() * ::sysconf(_SC_PAGESIZE) : 0;
+}
+
+qint64 processCpuNsecs()
+{
+    timespec ts {};
+    ::clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return static_cast<qint64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+//////////////////////////
+// Transport: library calls or HTTP to local service
+
+class Target
+{
+public:
+    virtual ~Target() = default;
+    virtual bool issue(QString& answer, QString& token) = 0;
+    virtual bool validate(const QString& answer, const QString& token) = 0;
+};
+
+class InProcess: public Target
+{
+public:
+    bool issue(QString& answer, QString& token) override
+    {
+        const auto captcha = ZeroStorageCaptcha::cached();
+        if (captcha.isNull()) return false; // render budget exhausted, nothing to recycle
+        answer = captcha->answer();
+        token = captcha->token();
+        return true;
+    }
+
+    bool validate(const QString& answer, const QString& token) override
+    {
+        return ZeroStorageCaptcha::validate(answer, token);
+    }
+};
+
+class Service: public Target
+{
+public:
+    Service(const QByteArray& host, quint16 port): m_host(host), m_port(port) {}
+    ~Service() override { if (m_fd >= 0) ::close(m_fd); }
+
+    bool issue(QString& answer, QString& token) override
+    {
+        QByteArray headers;
+        if (not request("/captcha", headers)) return false;
+        const int begin = headers.indexOf("\r\nx-captcha-token:");
+        const int end = headers.indexOf("\r\n", begin + 2);
+        token = QString::fromLatin1(headers.mid(begin + 18, end < 0 ? -1 : end - begin - 18).trimmed());
+        answer = "-"; // unknown outside of the service
+        return begin >= 0;
+    }
+
+    bool validate(const QString& answer, const QString& token) override
+    {
+        QByteArray headers;
+        return request("/validate?answer=" + answer.toUtf8().toPercentEncoding() + "&token=" + token.toLatin1(), headers) and
+               m_body.contains("true");
+    }
+
+private:
+    bool connectToService()
+    {
+        m_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in addr {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(m_port);
+        int on = 1;
+        ::setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        if (::inet_pton(AF_INET, m_host.constData(), &addr.sin_addr) != 1 or
+            ::connect(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+        {
+            ::close(m_fd);
+            m_fd = -1;
+            return false;
+        }
+        return true;
+    }
+
+    bool request(const QByteArray& target, QByteArray& headers)
+    {
+        if (m_fd < 0 and not connectToService()) return false;
+
+        const QByteArray data = "GET " + target + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        if (::send(m_fd, data.constData(), static_cast<size_t>(data.size()), MSG_NOSIGNAL) != data.size())
+        {
+            ::close(m_fd);
+            m_fd = -1;
+            return false;
+        }
+
+        QByteArray input;
+        char buffer[16 * 1024];
+        int end = -1;
+        qsizetype length = -1;
+        while (length < 0 or input.size() < end + 4 + length)
+        {
+            const ssize_t received = ::recv(m_fd, buffer, sizeof(buffer), 0);
+            if (received <= 0)
+            {
+                ::close(m_fd);
+                m_fd = -1;
+                return false;
+            }
+            input.append(buffer, static_cast<int>(received));
+
+            if (end < 0 and (end = input.indexOf("\r\n\r\n")) >= 0)
+            {
+                headers = input.left(end).toLower();
+                const int contentLength = headers.indexOf("\r\ncontent-length:");
+                if (contentLength < 0) return false;
+                const int valueEnd = headers.indexOf("\r\n", contentLength + 2);
+                length = headers.mid(contentLength + 17, valueEnd < 0 ? -1 : valueEnd - contentLength - 17).trimmed().toLongLong();
+            }
+        }
+        m_body = input.mid(end + 4, length);
+        return headers.startsWith("http/1.1 200");
+    }
+
+    QByteArray m_host;
+    quint16 m_port;
+    int m_fd = -1;
+    QByteArray m_body;
+};
+
+//////////////////////////
+
+class Simulation
+{
+public:
+    Simulation(Target& target, const Profile& profile, bool simulatedClock)
+        : m_target(target), m_profile(profile), m_simulatedClock(simulatedClock) {}
+
+    void run(qint64 durationMsecs, qint64 stepMsecs, qint64 reportMsecs);
+
+private:
+    void tick(qint64 stepMsecs);
+    int events(qreal rps, qreal& carry, qint64 stepMsecs);
+    bool timedIssue(QString& answer, QString& token);
+    bool timedValidate(const QString& answer, const QString& token);
+    void report(qint64 fromMsecs);
+
+    Target& m_target;
+    Profile m_profile;
+    bool m_simulatedClock;
+
+    qint64 m_nowMsecs = 0;
+    qint64 m_nextRotationMsecs = 0;
+    qreal m_carry[5] {};
+
+    std::deque<Issued> m_pendingSolves;  // legitimate users thinking
+    std::deque<Issued> m_previousWindow; // issued, answered after the next rotation
+    std::vector<Issued> m_solved;        // replay pool
+
+    std::vector<qint64> m_latency[OperationsCount];
+    Counters m_counters;
+    qint64 m_maxUsedTokensMemory = 0;
+    qint64 m_cpuStartNsecs = 0;
+    qint64 m_reportWallNsecs = 0;
+    QElapsedTimer m_wall;
+};
+
+int Simulation::events(qreal rps, qreal& carry, qint64 stepMsecs)
+{
+    carry += rps * stepMsecs / 1000.0;
+    const int count = static_cast<int>(carry);
+    carry -= count;
+    return count;
+}
+
+bool Simulation::timedIssue(QString& answer, QString& token)
+{
+    const qint64 start = m_wall.nsecsElapsed();
+    const bool result = m_target.issue(answer, token);
+    m_latency[Issue].push_back(m_wall.nsecsElapsed() - start);
+    ++m_counters.issued;
+    return result;
+}
+
+bool Simulation::timedValidate(const QString& answer, const QString& token)
+{
+    const qint64 start = m_wall.nsecsElapsed();
+    const bool result = m_target.validate(answer, token);
+    m_latency[Validate].push_back(m_wall.nsecsElapsed() - start);
+    ++m_counters.validations;
+    if (result) ++m_counters.accepted;
+    return result;
+}
+
+void Simulation::tick(qint64 stepMsecs)
+{
+    QString answer;
+    QString token;
+
+    for (int i = events(m_profile.floodRps, m_carry[0], stepMsecs); i > 0; --i)
+    {
+        timedIssue(answer, token);
+    }
+
+    for (int i = events(m_profile.wrongRps, m_carry[1], stepMsecs); i > 0; --i)
+    {
+        if (timedIssue(answer, token))
+        {
+            timedValidate(answer + "x", token);
+        }
+    }
+
+    for (int i = events(m_profile.legitRps, m_carry[2], stepMsecs); i > 0; --i)
+    {
+        if (timedIssue(answer, token))
+        {
+            const bool correct = QRandomGenerator::global()->generateDouble() < m_profile.solveRate;
+            m_pendingSolves.push_back({answer, token, m_nowMsecs + m_profile.thinkMsecs, correct});
+        }
+    }
+
+    while (not m_pendingSolves.empty() and m_pendingSolves.front().atMsecs <= m_nowMsecs)
+    {
+        const Issued solve = m_pendingSolves.front();
+        m_pendingSolves.pop_front();
+        ++m_counters.legitAttempts;
+        if (timedValidate(solve.correct ? solve.answer : solve.answer + "x", solve.token))
+        {
+            ++m_counters.legitAccepted;
+            m_solved.push_back(solve);
+            if (m_solved.size() > 4096)
+            {
+                m_solved.erase(m_solved.begin(), m_solved.begin() + 2048);
+            }
+        }
+    }
+
+    for (int i = events(m_profile.replayRps, m_carry[3], stepMsecs); i > 0 and not m_solved.empty(); --i)
+    {
+        const Issued& solved = m_solved[QRandomGenerator::global()->bounded(static_cast<quint32>(m_solved.size()))];
+        if (timedValidate(solved.answer, solved.token))
+        {
+            ++m_counters.replaysAccepted;
+        }
+    }
+
+    // Answered one rotation interval after issue: valid only by the previous time token
+    for (int i = events(m_profile.staleRps, m_carry[4], stepMsecs); i > 0; --i)
+    {
+        if (timedIssue(answer, token))
+        {
+            m_previousWindow.push_back({answer, token, m_nowMsecs + ZeroStorageCaptchaService::TimeToken::rotationInterval(), true});
+        }
+    }
+
+    while (not m_previousWindow.empty() and m_previousWindow.front().atMsecs <= m_nowMsecs)
+    {
+        const Issued stale = m_previousWindow.front();
+        m_previousWindow.pop_front();
+        ++m_counters.staleAttempts;
+        if (timedValidate(stale.answer, stale.token))
+        {
+            ++m_counters.staleAccepted;
+        }
+    }
+}
+
+void Simulation::run(qint64 durationMsecs, qint64 stepMsecs, qint64 reportMsecs)
+{
+    if (m_simulatedClock)
+    {
+        ZeroStorageCaptchaService::Clock::setSimulated(true);
+        ZeroStorageCaptchaService::TimeToken::setAutoRotation(false);
+        m_nextRotationMsecs = ZeroStorageCaptchaService::TimeToken::rotationInterval();
+    }
+
+    ZeroStorageCaptchaService::Cache::resetStats();
+    m_wall.start();
+    m_cpuStartNsecs = processCpuNsecs();
+
+    qint64 nextReport = reportMsecs;
+    qint64 reportFrom = 0;
+    while (m_nowMsecs < durationMsecs)
+    {
+        if (m_simulatedClock)
+        {
+            ZeroStorageCaptchaService::Clock::advance(stepMsecs * 1000000);
+            while (m_nowMsecs >= m_nextRotationMsecs)
+            {
+                ZeroStorageCaptchaService::TimeToken::rotate();
+                m_nextRotationMsecs += ZeroStorageCaptchaService::TimeToken::rotationInterval();
+            }
+        }
+        else
+        {
+            const qint64 lag = m_nowMsecs - m_wall.elapsed();
+            if (lag > 0) QThread::msleep(static_cast<unsigned long>(lag));
+        }
+
+        tick(stepMsecs);
+        m_nowMsecs += stepMsecs;
+        m_maxUsedTokensMemory = qMax<qint64>(m_maxUsedTokensMemory, ZeroStorageCaptcha::usedTokensMemoryUsage());
+
+        if (m_nowMsecs >= nextReport or m_nowMsecs >= durationMsecs)
+        {
+            report(reportFrom);
+            reportFrom = m_nowMsecs;
+            nextReport += reportMsecs;
+        }
+    }
+
+    if (m_simulatedClock)
+    {
+        ZeroStorageCaptchaService::Clock::setSimulated(false);
+    }
+}
+
+void Simulation::report(qint64 fromMsecs)
+{
+    const auto percentile = [](std::vector<qint64>& values, qreal p) -> QString {
+        if (values.empty()) return "-";
+        std::sort(values.begin(), values.end());
+        return QString::number(values[static_cast<size_t>(p * (values.size() - 1))] / 1000.0, 'f', 1);
+    };
+
+    const qreal wallSecs = (m_wall.nsecsElapsed() - m_reportWallNsecs) / 1e9;
+    const qint64 operations = static_cast<qint64>(m_latency[Issue].size() + m_latency[Validate].size());
+    const auto stats = ZeroStorageCaptchaService::Cache::stats();
+    const qint64 cacheIssues = stats.reused + stats.recycled + stats.rendered + stats.composed + stats.rejected;
+
+    qInfo().noquote() << QString("[%1 - %2 min simulated]").arg(fromMsecs / 60000).arg(m_nowMsecs / 60000);
+    qInfo().noquote() << "  throughput:" << QString::number(operations / wallSecs, 'f', 0) << "ops/s wall,"
+                      << m_counters.issued << "issued," << m_counters.validations << "validated";
+    qInfo().noquote() << "  issue us p50/p99/p999:" << percentile(m_latency[Issue], 0.5) + "/" + percentile(m_latency[Issue], 0.99) + "/" + percentile(m_latency[Issue], 0.999)
+                      << "| validate us p50/p99/p999:" << percentile(m_latency[Validate], 0.5) + "/" + percentile(m_latency[Validate], 0.99) + "/" + percentile(m_latency[Validate], 0.999);
+    if (cacheIssues > 0)
+    {
+        qInfo().noquote() << "  cache hit rate:" << QString::number(100.0 * (stats.reused + stats.recycled) / cacheIssues, 'f', 1) + "%"
+                          << "(reused" << stats.reused << "| recycled" << stats.recycled << "| rendered" << stats.rendered << "| composed" << stats.composed << "| rejected" << stats.rejected << ")"
+                          << "| cache" << ZeroStorageCaptcha::cacheSize() << "entries," << ZeroStorageCaptcha::cacheMemoryUsage() << "bytes";
+    }
+    qInfo().noquote() << "  replay set:" << ZeroStorageCaptcha::usedTokensMemoryUsage() << "bytes now," << m_maxUsedTokensMemory << "bytes max"
+                      << "| RSS:" << residentBytes() << "bytes"
+                      << "| image arena:" << ZeroStorageCaptchaService::ImageArena::usedBytes() << "/" << ZeroStorageCaptchaService::ImageArena::reservedBytes() << "bytes"
+                      << "| CPU per issued captcha:" << (m_counters.issued ? QString::number((processCpuNsecs() - m_cpuStartNsecs) / 1000.0 / m_counters.issued, 'f', 1) : "-") << "us";
+    qInfo().noquote() << "  legit accepted:" << m_counters.legitAccepted << "/" << m_counters.legitAttempts
+                      << "| previous window accepted:" << m_counters.staleAccepted << "/" << m_counters.staleAttempts
+                      << "| replays accepted (must be 0):" << m_counters.replaysAccepted;
+
+    // Latency and throughput are per report interval, counters are cumulative
+    for (auto& latency: m_latency)
+    {
+        latency.clear();
+    }
+    m_reportWallNsecs = m_wall.nsecsElapsed();
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+    {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QGuiApplication a(argc, argv);
+
+    const Profile defaults;
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Zero Storage Captcha load replay");
+    parser.addHelpOption();
+    parser.addOptions({
+        {"service", "Send traffic to zerostoragecaptcha-server at host:port in real time.", "host:port"},
+        {"minutes", "Simulated duration.", "minutes", "60"},
+        {"step", "Simulation step.", "msecs", "100"},
+        {"report", "Report interval (simulated).", "minutes", "15"},
+        {"flood", "Issue flood.", "rps", QString::number(defaults.floodRps)},
+        {"wrong", "Wrong answer spam.", "rps", QString::number(defaults.wrongRps)},
+        {"replay", "Replays of solved tokens.", "rps", QString::number(defaults.replayRps)},
+        {"stale", "Answers with tokens from the previous time window.", "rps", QString::number(defaults.staleRps)},
+        {"legit", "Legitimate users.", "rps", QString::number(defaults.legitRps)},
+        {"solve-rate", "Correct share of legitimate answers.", "0..1", QString::number(defaults.solveRate)},
+        {"think", "Legitimate user think time.", "msecs", QString::number(defaults.thinkMsecs)},
+        {"difficulty", "Captcha difficulty (0-2).", "level", QString::number(ZeroStorageCaptcha::defaultDifficulty())},
+        {"cache", "Cache capacity (captchas).", "count", QString::number(ZeroStorageCaptcha::cacheMaxCapacity())},
+        {"render-budget", "Renders per second, 0 - unlimited.", "rps", "0"},
+        {"sprites", "Compose from glyph library when render budget is exhausted."},
+        {"compose-budget", "Sprite compositions per second, 0 - unlimited.", "rps", QString::number(ZeroStorageCaptchaService::Cache::composeBudget())},
+        {"arena", "Store pictures in slab arena."},
+        {"huge-pages", "Back slab arena with huge pages."},
+    });
+    parser.process(a);
+
+    Profile profile;
+    profile.floodRps = parser.value("flood").toDouble();
+    profile.wrongRps = parser.value("wrong").toDouble();
+    profile.replayRps = parser.value("replay").toDouble();
+    profile.staleRps = parser.value("stale").toDouble();
+    profile.legitRps = parser.value("legit").toDouble();
+    profile.solveRate = parser.value("solve-rate").toDouble();
+    profile.thinkMsecs = parser.value("think").toLongLong();
+
+    ZeroStorageCaptcha::setDefaultDifficulty(parser.value("difficulty").toInt());
+    ZeroStorageCaptcha::setCacheMaxCapacity(parser.value("cache").toLongLong());
+    ZeroStorageCaptcha::setCacheRenderBudget(parser.value("render-budget").toDouble());
+    ZeroStorageCaptcha::setImageArena(parser.isSet("arena") or parser.isSet("huge-pages"), parser.isSet("huge-pages"));
+    if (parser.isSet("sprites"))
+    {
+        ZeroStorageCaptchaService::GlyphLibrary::build(ZeroStorageCaptcha::defaultDifficulty());
+        ZeroStorageCaptchaService::Cache::setComposeBudget(parser.value("compose-budget").toDouble());
+        ZeroStorageCaptchaService::Cache::setSpriteTier(true);
+    }
+
+    InProcess inProcess;
+    QScopedPointer<Service> service;
+    if (parser.isSet("service"))
+    {
+        const QStringList address = parser.value("service").split(':');
+        if (address.size() != 2)
+        {
+            qCritical() << "--service expects host:port";
+            return 1;
+        }
+        service.reset(new Service(address.first().toLatin1(), static_cast<quint16>(address.last().toUInt())));
+    }
+
+    Target& target = service ? static_cast<Target&>(*service) : static_cast<Target&>(inProcess);
+    Simulation simulation(target, profile, not service);
+    simulation.run(parser.value("minutes").toLongLong() * 60000,
+                   qMax<qint64>(1, parser.value("step").toLongLong()),
+                   qMax<qint64>(1, parser.value("report").toLongLong()) * 60000);
+
+    return 0;
+}
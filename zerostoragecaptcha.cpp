@@ -25,6 +25,7 @@
 #include "zerostoragecaptcha.h"
 
 #include <QTime>
+#include <QDeadlineTimer>
 #include <QBuffer>
 #include <QDebug>
 #include <QPainter>
@@ -32,10 +33,176 @@
 #include <QRandomGenerator>
 #include <QRegularExpression>
 #include <QCryptographicHash>
+#include <QThread>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iterator>
+#include <vector>
+
+#ifdef Q_OS_LINUX
+#include <sys/mman.h>
+#endif
+
+// PCLMULQDQ CRC-32 and SSSE3 Adler-32 for the builtin PNG encoder, chosen at run time
+#if defined(Q_PROCESSOR_X86_64) && defined(Q_CC_GNU)
+#define ZEROSTORAGECAPTCHA_X86_SIMD
+#include <immintrin.h>
+#endif
 
 bool ZeroStorageCaptcha::m_onlyNumbers = false;
+bool ZeroStorageCaptcha::m_fastOverlay = false;
+bool ZeroStorageCaptcha::m_builtinPng = false;
+
+namespace {
+
+// Direct Format_RGB32 kernels for the post-text overlay. Each primitive is drawn row by row
+// into QImage::scanLine() with branch-free inner loops (coverage -> blend), so the compiler can
+// vectorize them and no QPainter state is touched per primitive.
+
+inline float clampCoverage(float value)
+{
+    return value < 0.0f ? 0.0f : (value > 1.0f ? 1.0f : value);
+}
+
+inline quint32 blendPixel(quint32 dst, quint32 src, int alpha /* 0..256 */)
+{
+    const quint32 inv = static_cast<quint32>(256 - alpha);
+    const quint32 a = static_cast<quint32>(alpha);
+    const quint32 rb = (((dst & 0x00ff00ff) * inv + (src & 0x00ff00ff) * a) >> 8) & 0x00ff00ff;
+    const quint32 g  = (((dst & 0x0000ff00) * inv + (src & 0x0000ff00) * a) >> 8) & 0x0000ff00;
+    return 0xff000000 | rb | g;
+}
+
+// Half-open interval of px where lo < px * k + c < hi (k may be zero), intersected into [from, to)
+inline void clipSpan(float k, float c, float lo, float hi, float& from, float& to)
+{
+    if (k == 0.0f)
+    {
+        if (c <= lo or c >= hi) to = from; // empty
+        return;
+    }
+    float a = (lo - c) / k;
+    float b = (hi - c) / k;
+    if (a > b) std::swap(a, b);
+    from = qMax(from, a);
+    to = qMin(to, b);
+}
+
+// Antialiased segment with square caps (QPen default), same geometry as QPainter::drawLine().
+// Per row only the span where the rotated rectangle (widened by 0.5 for antialiasing) can cover
+// pixel centers is visited, so a diagonal line costs its area, not its bounding box.
+void fastLine(QImage& image, int x1, int y1, int x2, int y2, float width, QRgb color)
+{
+    const float hw = width / 2.0f;
+    const float dx = static_cast<float>(x2 - x1);
+    const float dy = static_cast<float>(y2 - y1);
+    const float len = std::sqrt(dx * dx + dy * dy);
+    const float ux = len > 0.0f ? dx / len : 1.0f;
+    const float uy = len > 0.0f ? dy / len : 0.0f;
+    const float reach = hw + 0.5f; // coverage is zero beyond it across and past the caps
+
+    const int left   = qMax(0, static_cast<int>(std::floor(qMin(x1, x2) - hw - 1.0f)));
+    const int right  = qMin(image.width() - 1, static_cast<int>(std::ceil(qMax(x1, x2) + hw + 1.0f)));
+    const int top    = qMax(0, static_cast<int>(std::floor(qMin(y1, y2) - hw - 1.0f)));
+    const int bottom = qMin(image.height() - 1, static_cast<int>(std::ceil(qMax(y1, y2) + hw + 1.0f)));
+
+    for (int y = top; y <= bottom; ++y)
+    {
+        quint32* row = reinterpret_cast<quint32*>(image.scanLine(y));
+        const float py = y + 0.5f - y1;
+
+        // across = |py * ux - px * uy| < reach, -reach < along = px * ux + py * uy < len + reach
+        float from = left + 0.5f - x1;
+        float to = right + 0.5f - x1;
+        clipSpan(-uy, py * ux, -reach, reach, from, to);
+        clipSpan(ux, py * uy, -reach, len + reach, from, to);
+        if (from >= to) continue;
+
+        // One pixel of slack on both sides against float rounding at the span ends
+        const int spanLeft = qMax(left, static_cast<int>(std::floor(from + x1 - 0.5f)) - 1);
+        const int spanRight = qMin(right, static_cast<int>(std::ceil(to + x1 - 0.5f)) + 1);
+        for (int x = spanLeft; x <= spanRight; ++x)
+        {
+            const float px = x + 0.5f - x1;
+            const float along = px * ux + py * uy;
+            const float across = std::fabs(py * ux - px * uy);
+            const float coverage = clampCoverage(hw + 0.5f - across) *
+                                   clampCoverage(qMin(along + hw, len + hw - along) + 0.5f);
+            row[x] = blendPixel(row[x], color, static_cast<int>(coverage * 256.0f));
+        }
+    }
+}
+
+// CompositionMode_Difference (|dst - src|) or CompositionMode_Exclusion (dst + src - 2 * dst * src)
+// per RGB channel, as QPainter blends an opaque brush into Format_RGB32
+inline quint32 compositePixel(quint32 dst, quint32 src, bool difference)
+{
+    quint32 result = 0xff000000;
+    for (int shift = 0; shift <= 16; shift += 8)
+    {
+        const int d = static_cast<int>((dst >> shift) & 0xff);
+        const int s = static_cast<int>((src >> shift) & 0xff);
+        const int value = difference ? qAbs(d - s) : d + s - (2 * d * s + 127) / 255;
+        result |= static_cast<quint32>(value) << shift;
+    }
+    return result;
+}
+
+// Antialiased filled ellipse drawn with Difference (black back, font color brush) or
+// Exclusion (other back, back color brush) composition, as the QPainter branch does
+void fastCompositeEllipse(QImage& image, int cx, int cy, int rx, int ry, QRgb brush, bool difference)
+{
+    if (rx <= 0 or ry <= 0) return;
+
+    const float frx = static_cast<float>(rx);
+    const float fry = static_cast<float>(ry);
+    const float edge = qMin(frx, fry);
+
+    const int left   = qMax(0, cx - rx - 1);
+    const int right  = qMin(image.width() - 1, cx + rx + 1);
+    const int top    = qMax(0, cy - ry - 1);
+    const int bottom = qMin(image.height() - 1, cy + ry + 1);
 
-void ZeroStorageCaptcha::init()
+    for (int y = top; y <= bottom; ++y)
+    {
+        quint32* row = reinterpret_cast<quint32*>(image.scanLine(y));
+        const float ny = (y + 0.5f - cy) / fry;
+        for (int x = left; x <= right; ++x)
+        {
+            const float nx = (x + 0.5f - cx) / frx;
+            const float distance = (std::sqrt(nx * nx + ny * ny) - 1.0f) * edge;
+            const float coverage = clampCoverage(0.5f - distance);
+            row[x] = blendPixel(row[x], compositePixel(row[x], brush, difference), static_cast<int>(coverage * 256.0f));
+        }
+    }
+}
+
+// Square pen point (QPen default cap) centered at integer point, as QPainter::drawPoint() does
+void fastPoint(QImage& image, int cx, int cy, float size, QRgb color)
+{
+    const float hw = size / 2.0f;
+    const int left   = qMax(0, static_cast<int>(std::floor(cx - hw)));
+    const int right  = qMin(image.width() - 1, static_cast<int>(std::ceil(cx + hw)) - 1);
+    const int top    = qMax(0, static_cast<int>(std::floor(cy - hw)));
+    const int bottom = qMin(image.height() - 1, static_cast<int>(std::ceil(cy + hw)) - 1);
+
+    for (int y = top; y <= bottom; ++y)
+    {
+        quint32* row = reinterpret_cast<quint32*>(image.scanLine(y));
+        const float cyCoverage = clampCoverage(qMin(y + 1.0f, cy + hw) - qMax(static_cast<float>(y), cy - hw));
+        for (int x = left; x <= right; ++x)
+        {
+            const float cxCoverage = clampCoverage(qMin(x + 1.0f, cx + hw) - qMax(static_cast<float>(x), cx - hw));
+            row[x] = blendPixel(row[x], color, static_cast<int>(cxCoverage * cyCoverage * 256.0f));
+        }
+    }
+}
+
+} // namespace
+
+void ZeroStorageCaptcha::init(QRandomGenerator *source)
 {
     ZeroStorageCaptchaService::TimeToken::init();
 
@@ -52,7 +219,14 @@ void ZeroStorageCaptcha::init()
 
     m_captchaImage = QImage(200, 100, QImage::Format_RGB32);
 
-    if (QTime::currentTime().msec() % 2 == 0)
+#ifdef ZEROSTORAGECAPTCHA_DETERMINISTIC
+    const bool whiteBack = source->bounded(2) == 0;
+#else
+    Q_UNUSED(source)
+    const bool whiteBack = QTime::currentTime().msec() % 2 == 0;
+#endif
+
+    if (whiteBack)
     {
         m_backColor = Qt::GlobalColor::white;
         m_fontColor = Qt::GlobalColor::black;
@@ -80,6 +254,12 @@ ZeroStorageCaptcha::ZeroStorageCaptcha(const QString &answer, int difficulty)
     render();
 }
 
+ZeroStorageCaptcha::ZeroStorageCaptcha(int difficulty, QRandomGenerator *source)
+{
+    init(source);
+    setDifficulty(difficulty, source);
+}
+
 QSharedPointer<ZeroStorageCaptcha> ZeroStorageCaptcha::cached()
 {
     return ZeroStorageCaptchaService::Cache::get();
@@ -105,6 +285,71 @@ qsizetype ZeroStorageCaptcha::cacheSize()
     return ZeroStorageCaptchaService::Cache::size();
 }
 
+void ZeroStorageCaptcha::setCacheMaxMemory(qsizetype bytes)
+{
+    ZeroStorageCaptchaService::Cache::setMaxMemory(bytes);
+}
+
+qsizetype ZeroStorageCaptcha::cacheMaxMemory()
+{
+    return ZeroStorageCaptchaService::Cache::maxMemory();
+}
+
+qsizetype ZeroStorageCaptcha::cacheMemoryUsage()
+{
+    return ZeroStorageCaptchaService::Cache::memoryUsage();
+}
+
+qsizetype ZeroStorageCaptcha::usedTokensMemoryUsage()
+{
+    return ZeroStorageCaptchaService::TokenManager::usedTokensMemoryUsage();
+}
+
+void ZeroStorageCaptcha::setCacheRenderBudget(qreal rendersPerSecond, int burst)
+{
+    ZeroStorageCaptchaService::Cache::setRenderBudget(rendersPerSecond, burst);
+}
+
+qreal ZeroStorageCaptcha::cacheRenderBudget()
+{
+    return ZeroStorageCaptchaService::Cache::renderBudget();
+}
+
+void ZeroStorageCaptcha::setCachePayloads(bool enabled)
+{
+    ZeroStorageCaptchaService::Cache::setPayloadCaching(enabled);
+}
+
+bool ZeroStorageCaptcha::cachePayloads()
+{
+    return ZeroStorageCaptchaService::Cache::payloadCaching();
+}
+
+void ZeroStorageCaptcha::setImageArena(bool enabled, bool hugePages)
+{
+    ZeroStorageCaptchaService::ImageArena::setEnabled(enabled, hugePages);
+}
+
+bool ZeroStorageCaptcha::imageArena()
+{
+    return ZeroStorageCaptchaService::ImageArena::enabled();
+}
+
+void ZeroStorageCaptcha::setSpriteTier(bool enabled, int variants, qreal composesPerSecond)
+{
+    ZeroStorageCaptchaService::Cache::setComposeBudget(composesPerSecond);
+    ZeroStorageCaptchaService::Cache::setSpriteTier(enabled);
+    if (enabled and not ZeroStorageCaptchaService::GlyphLibrary::ready(defaultDifficulty()))
+    {
+        ZeroStorageCaptchaService::GlyphLibrary::buildInBackground(defaultDifficulty(), variants);
+    }
+}
+
+bool ZeroStorageCaptcha::spriteTier()
+{
+    return ZeroStorageCaptchaService::Cache::spriteTier();
+}
+
 void ZeroStorageCaptcha::setDefaultAnswerLength(int length)
 {
     ZeroStorageCaptchaService::Cache::setAnswerLength(length);
@@ -146,20 +391,105 @@ QString ZeroStorageCaptcha::token() const
 
 QByteArray ZeroStorageCaptcha::picturePng() const
 {
+    if (not m_png.isEmpty())
+    {
+        return m_png;
+    }
+
     QByteArray data;
+    if (m_builtinPng)
+    {
+        ZeroStorageCaptchaService::PngEncoder::encode(m_captchaImage, data);
+        return data;
+    }
+
     QBuffer buff(&data);
     m_captchaImage.save(&buff, "PNG");
     return data;
 }
 
+QByteArray ZeroStorageCaptcha::pictureDataUri() const
+{
+    if (not m_dataUri.isEmpty())
+    {
+        return m_dataUri;
+    }
+
+    return "data:image/png;base64," + picturePng().toBase64();
+}
+
+ZeroStorageCaptcha::JsonPayload ZeroStorageCaptcha::jsonPayload() const
+{
+    static const QByteArray prefix ("{\"image\":\"");
+    static const QByteArray middle ("\",\"token\":\"");
+    static const QByteArray tail ("\"}");
+
+    return { prefix, pictureDataUri(), middle, tail };
+}
+
+QByteArray ZeroStorageCaptcha::json() const
+{
+    QByteArray data;
+    json(data);
+    return data;
+}
+
+qsizetype ZeroStorageCaptcha::json(QByteArray& out) const
+{
+    const JsonPayload payload = jsonPayload();
+    const QByteArray tokenBytes = token().toLatin1();
+
+    const qsizetype written = payload.size() + tokenBytes.size();
+    out.reserve(out.size() + written);
+    out.append(payload.prefix);
+    out.append(payload.dataUri);
+    out.append(payload.middle);
+    out.append(tokenBytes);
+    out.append(payload.tail);
+    return written;
+}
+
+void ZeroStorageCaptcha::preparePayloads()
+{
+    dropPayloads();
+
+    // Encoders grow their buffers to a worst-case bound: cached copies keep only the real size
+    m_png = picturePng();
+    m_png.squeeze();
+    m_dataUri = pictureDataUri();
+    m_dataUri.squeeze();
+}
+
+qsizetype ZeroStorageCaptcha::memoryUsage() const
+{
+    // Token is generated lazily, so an unissued captcha is accounted with a typical token length
+    constexpr qsizetype TOKEN_LENGTH_ESTIMATE = 32;
+    constexpr qsizetype HEAP_OVERHEAD = 2 * sizeof(void*); // allocator header per heap block
+    constexpr qsizetype QIMAGE_PRIVATE_SIZE = 128;         // QImageData without pixels
+
+    qsizetype bytes = sizeof(ZeroStorageCaptcha) + HEAP_OVERHEAD;
+    const qsizetype slot = m_arenaImage ? ZeroStorageCaptchaService::ImageArena::slotSize(m_captchaImage.sizeInBytes()) : 0;
+    bytes += (slot > 0 ? slot : m_captchaImage.sizeInBytes() + HEAP_OVERHEAD) + QIMAGE_PRIVATE_SIZE;
+    bytes += m_captchaText.capacity() * static_cast<qsizetype>(sizeof(QChar)) + HEAP_OVERHEAD;
+    bytes += qMax<qsizetype>(m_token.capacity(), TOKEN_LENGTH_ESTIMATE) * static_cast<qsizetype>(sizeof(QChar)) + HEAP_OVERHEAD;
+    for (const QByteArray* payload: {&m_png, &m_dataUri})
+    {
+        if (payload->isEmpty()) continue;
+        bytes += payload->capacity() + HEAP_OVERHEAD;
+    }
+    return bytes;
+}
+
 void ZeroStorageCaptcha::render()
 {
+    dropPayloads();
+
     QPainterPath path;
     QFontMetrics fm(m_font);
 
     path.addText(m_vmod2 + m_padding, m_hmod2 - m_padding + fm.height(), font(), answer());
 
-    qreal sinrandomness = QRandomGenerator::system()->generateDouble() * 5.0;
+    qreal sinrandomness = ZeroStorageCaptchaService::generator()->generateDouble() * 5.0;
 
     for (int i = 0; i < path.elementCount(); ++i)
     {
@@ -169,9 +499,10 @@ void ZeroStorageCaptcha::render()
         path.setElementPositionAt(i, x, y);
     }
 
-    m_captchaImage = QImage(static_cast<int>(fm.horizontalAdvance(m_captchaText) + m_vmod2 * 2 + m_padding * 2),
-                            static_cast<int>(fm.height() + m_hmod2 * 2 + m_padding * 2), QImage::Format_RGB32);
+    const int width = static_cast<int>(fm.horizontalAdvance(m_captchaText) + m_vmod2 * 2 + m_padding * 2);
+    const int height = static_cast<int>(fm.height() + m_hmod2 * 2 + m_padding * 2);
 
+    allocateImage(width, height);
     m_captchaImage.fill(backColor());
 
     QPainter painter;
@@ -181,15 +512,22 @@ void ZeroStorageCaptcha::render()
     painter.setRenderHint(QPainter::Antialiasing);
     painter.drawPath(path);
 
+    if (m_fastOverlay)
+    {
+        painter.end();
+        renderOverlayFast();
+        return;
+    }
+
     if (m_drawLines)
     {
         painter.setPen(QPen(Qt::black, m_lineWidth));
         for (int i = 0; i < m_lineCount; i++)
         {
-            int x1 = static_cast<int>(QRandomGenerator::system()->generateDouble() * m_captchaImage.width());
-            int y1 = static_cast<int>(QRandomGenerator::system()->generateDouble() * m_captchaImage.height());
-            int x2 = static_cast<int>(QRandomGenerator::system()->generateDouble() * m_captchaImage.width());
-            int y2 = static_cast<int>(QRandomGenerator::system()->generateDouble() * m_captchaImage.height());
+            int x1 = static_cast<int>(ZeroStorageCaptchaService::generator()->generateDouble() * m_captchaImage.width());
+            int y1 = static_cast<int>(ZeroStorageCaptchaService::generator()->generateDouble() * m_captchaImage.height());
+            int x2 = static_cast<int>(ZeroStorageCaptchaService::generator()->generateDouble() * m_captchaImage.width());
+            int y2 = static_cast<int>(ZeroStorageCaptchaService::generator()->generateDouble() * m_captchaImage.height());
             painter.drawLine(x1, y1, x2, y2);
         }
         painter.setPen(Qt::NoPen);
@@ -199,10 +537,10 @@ void ZeroStorageCaptcha::render()
     {
         for (int i = 0; i < m_ellipseCount; i++)
         {
-            int x1 = static_cast<int>(m_ellipseMaxRadius / 2.0 + QRandomGenerator::system()->generateDouble() * (m_captchaImage.width() - m_ellipseMaxRadius));
-            int y1 = static_cast<int>(m_ellipseMaxRadius / 2.0 + QRandomGenerator::system()->generateDouble() * (m_captchaImage.height() - m_ellipseMaxRadius));
-            int rad1 = static_cast<int>(m_ellipseMinRadius + QRandomGenerator::system()->generateDouble() * (m_ellipseMaxRadius - m_ellipseMinRadius));
-            int rad2 = static_cast<int>(m_ellipseMinRadius + QRandomGenerator::system()->generateDouble() * (m_ellipseMaxRadius - m_ellipseMinRadius));
+            int x1 = static_cast<int>(m_ellipseMaxRadius / 2.0 + ZeroStorageCaptchaService::generator()->generateDouble() * (m_captchaImage.width() - m_ellipseMaxRadius));
+            int y1 = static_cast<int>(m_ellipseMaxRadius / 2.0 + ZeroStorageCaptchaService::generator()->generateDouble() * (m_captchaImage.height() - m_ellipseMaxRadius));
+            int rad1 = static_cast<int>(m_ellipseMinRadius + ZeroStorageCaptchaService::generator()->generateDouble() * (m_ellipseMaxRadius - m_ellipseMinRadius));
+            int rad2 = static_cast<int>(m_ellipseMinRadius + ZeroStorageCaptchaService::generator()->generateDouble() * (m_ellipseMaxRadius - m_ellipseMinRadius));
             if (backColor() == Qt::GlobalColor::black)
             {
                 painter.setBrush(fontColor());
@@ -219,8 +557,8 @@ void ZeroStorageCaptcha::render()
     {
         for (int i = 0; i < m_noiseCount; i++)
         {
-            int x1 = static_cast<int>(QRandomGenerator::system()->generateDouble() * m_captchaImage.width());
-            int y1 = static_cast<int>(QRandomGenerator::system()->generateDouble() * m_captchaImage.height());
+            int x1 = static_cast<int>(ZeroStorageCaptchaService::generator()->generateDouble() * m_captchaImage.width());
+            int y1 = static_cast<int>(ZeroStorageCaptchaService::generator()->generateDouble() * m_captchaImage.height());
 
             QColor col = backColor() == Qt::GlobalColor::black ? Qt::GlobalColor::white : Qt::GlobalColor::black;
 
@@ -233,6 +571,161 @@ void ZeroStorageCaptcha::render()
     painter.end();
 }
 
+bool ZeroStorageCaptcha::renderFromSprites()
+{
+    using ZeroStorageCaptchaService::GlyphLibrary;
+
+    const QSharedPointer<const GlyphLibrary::Library> library = GlyphLibrary::library();
+    if (library.isNull())
+    {
+        return false;
+    }
+
+    constexpr int JITTER = 2;
+
+    QVector<const GlyphLibrary::Glyph*> glyphs;
+    glyphs.reserve(m_captchaText.size());
+    int width = 0;
+    int margin = 0; // deform and padding around text
+    int height = 0;
+    for (const QChar symbol: m_captchaText)
+    {
+        const auto iter = library->glyphs.constFind(symbol);
+        if (iter == library->glyphs.constEnd() or iter->isEmpty())
+        {
+            return false;
+        }
+        const GlyphLibrary::Glyph* glyph = &iter->at(ZeroStorageCaptchaService::generator()->bounded(static_cast<int>(iter->size())));
+        glyphs.push_back(glyph);
+        width += glyph->advance;
+        margin = qMax(margin, glyph->mask.width() - glyph->advance);
+        height = qMax(height, glyph->mask.height());
+    }
+
+    dropPayloads();
+    allocateImage(width + margin, height);
+    m_captchaImage.fill(backColor());
+
+    const QRgb color = fontColor().rgb();
+    int offset = 0;
+    for (const GlyphLibrary::Glyph* glyph: glyphs)
+    {
+        const int gx = offset + ZeroStorageCaptchaService::generator()->bounded(-JITTER, JITTER + 1);
+        const int gy = ZeroStorageCaptchaService::generator()->bounded(-JITTER, JITTER + 1);
+        offset += glyph->advance;
+
+        const int left = qMax(0, -gx);
+        const int right = qMin(glyph->mask.width(), m_captchaImage.width() - gx);
+        const int top = qMax(0, -gy);
+        const int bottom = qMin(glyph->mask.height(), m_captchaImage.height() - gy);
+        for (int y = top; y < bottom; ++y)
+        {
+            const uchar* alpha = glyph->mask.constScanLine(y);
+            quint32* row = reinterpret_cast<quint32*>(m_captchaImage.scanLine(gy + y));
+            for (int x = left; x < right; ++x)
+            {
+                row[gx + x] = blendPixel(row[gx + x], color, alpha[x] + (alpha[x] >> 7));
+            }
+        }
+    }
+
+    renderOverlayFast();
+    return true;
+}
+
+ZeroStorageCaptchaService::GlyphLibrary::Glyph ZeroStorageCaptcha::renderGlyph(QChar symbol, const QFontMetrics &fm, QRandomGenerator *source) const
+{
+    const QString text(symbol);
+    const int advance = fm.horizontalAdvance(text);
+
+    // In render() the deform depends on the position in the answer, random shift stands for it
+    const qreal shift = source->generateDouble() * advance * 4;
+    const qreal sinrandomness = source->generateDouble() * 5.0;
+
+    QPainterPath path;
+    path.addText(m_vmod2 + m_padding, m_hmod2 - m_padding + fm.height(), m_font, text);
+    for (int i = 0; i < path.elementCount(); ++i)
+    {
+        const QPainterPath::Element& el = path.elementAt(i);
+        qreal y = el.y + sin((el.x + shift) / m_hmod1 + sinrandomness) * m_hmod2;
+        qreal x = el.x + sin(el.y / m_vmod1 + sinrandomness) * m_vmod2;
+        path.setElementPositionAt(i, x, y);
+    }
+
+    QImage mask(static_cast<int>(advance + m_vmod2 * 2 + m_padding * 2),
+                 static_cast<int>(fm.height() + m_hmod2 * 2 + m_padding * 2), QImage::Format_Alpha8);
+    mask.fill(Qt::transparent);
+
+    QPainter painter;
+    painter.begin(&mask);
+    painter.setPen(Qt::NoPen);
+    painter.setBrush(Qt::black);
+    painter.setRenderHint(QPainter::Antialiasing);
+    painter.drawPath(path);
+    painter.end();
+
+    return { mask, advance };
+}
+
+void ZeroStorageCaptcha::allocateImage(int width, int height)
+{
+    m_captchaImage = ZeroStorageCaptchaService::ImageArena::enabled() ? ZeroStorageCaptchaService::ImageArena::allocate(width, height) : QImage();
+    m_arenaImage = not m_captchaImage.isNull(); // accounted by its slot even if the arena is switched off later
+    if (m_captchaImage.isNull())
+    {
+        m_captchaImage = QImage(width, height, QImage::Format_RGB32);
+    }
+}
+
+void ZeroStorageCaptcha::dropPayloads()
+{
+    m_png.clear();
+    m_dataUri.clear();
+}
+
+void ZeroStorageCaptcha::renderOverlayFast()
+{
+    // Same random sequence and geometry as the QPainter branch of render()
+
+    if (m_drawLines)
+    {
+        const QRgb color = QColor(Qt::black).rgb();
+        for (int i = 0; i < m_lineCount; i++)
+        {
+            int x1 = static_cast<int>(ZeroStorageCaptchaService::generator()->generateDouble() * m_captchaImage.width());
+            int y1 = static_cast<int>(ZeroStorageCaptchaService::generator()->generateDouble() * m_captchaImage.height());
+            int x2 = static_cast<int>(ZeroStorageCaptchaService::generator()->generateDouble() * m_captchaImage.width());
+            int y2 = static_cast<int>(ZeroStorageCaptchaService::generator()->generateDouble() * m_captchaImage.height());
+            fastLine(m_captchaImage, x1, y1, x2, y2, m_lineWidth, color);
+        }
+    }
+
+    if (m_drawEllipses)
+    {
+        const bool difference = backColor() == Qt::GlobalColor::black;
+        const QRgb brush = difference ? fontColor().rgb() : backColor().rgb();
+        for (int i = 0; i < m_ellipseCount; i++)
+        {
+            int x1 = static_cast<int>(m_ellipseMaxRadius / 2.0 + ZeroStorageCaptchaService::generator()->generateDouble() * (m_captchaImage.width() - m_ellipseMaxRadius));
+            int y1 = static_cast<int>(m_ellipseMaxRadius / 2.0 + ZeroStorageCaptchaService::generator()->generateDouble() * (m_captchaImage.height() - m_ellipseMaxRadius));
+            int rad1 = static_cast<int>(m_ellipseMinRadius + ZeroStorageCaptchaService::generator()->generateDouble() * (m_ellipseMaxRadius - m_ellipseMinRadius));
+            int rad2 = static_cast<int>(m_ellipseMinRadius + ZeroStorageCaptchaService::generator()->generateDouble() * (m_ellipseMaxRadius - m_ellipseMinRadius));
+            fastCompositeEllipse(m_captchaImage, x1, y1, rad1, rad2, brush, difference);
+        }
+    }
+
+    if (m_drawNoise)
+    {
+        const QRgb color = backColor() == Qt::GlobalColor::black ? QColor(Qt::white).rgb() : QColor(Qt::black).rgb();
+        for (int i = 0; i < m_noiseCount; i++)
+        {
+            int x1 = static_cast<int>(ZeroStorageCaptchaService::generator()->generateDouble() * m_captchaImage.width());
+            int y1 = static_cast<int>(ZeroStorageCaptchaService::generator()->generateDouble() * m_captchaImage.height());
+            fastPoint(m_captchaImage, x1, y1, m_noisePointSize, color);
+        }
+    }
+}
+
 void ZeroStorageCaptcha::setSinDeform(qreal hAmplitude, qreal hFrequency, qreal vAmplitude, qreal vFrequency)
 {
     m_hmod1 = hFrequency;
@@ -243,7 +736,12 @@ void ZeroStorageCaptcha::setSinDeform(qreal hAmplitude, qreal hFrequency, qreal
 
 void ZeroStorageCaptcha::setDifficulty(int val)
 {
-    short variant = QRandomGenerator::system()->bounded(1, 3);
+    setDifficulty(val, ZeroStorageCaptchaService::generator());
+}
+
+void ZeroStorageCaptcha::setDifficulty(int val, QRandomGenerator *source)
+{
+    short variant = source->bounded(1, 3);
 
     if (val < 0 or val > 2)
     {
@@ -323,16 +821,25 @@ void ZeroStorageCaptcha::generateAnswer(int length)
         length = 5;
     }
 
-    m_captchaText = ZeroStorageCaptchaService::random(length, m_onlyNumbers);
+    m_captchaText = ZeroStorageCaptchaService::random(length, m_onlyNumbers, ZeroStorageCaptchaService::generator());
 } 
 
 //////////////////////////
 
+constexpr char randomtable[60] =
+     {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9',
+      'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j',
+      'k', 'l', 'm', 'n', 'k', 'p', 'q', 'r', 's', 't',
+      'u', 'v', 'w', 'x', 'y', 'z', 'A', 'B', 'C', 'D',
+      'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M', 'N',
+      'h', 'P', 'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X'};
+
 constexpr int TIME_TOKEN_SECRET_SIZE = 10;
 constexpr int TIMER_TO_CHANGE_TOKEN_MSECS = 90000; // 1,5 min
 
 namespace ZeroStorageCaptchaService {
 
+QMutex                      TimeToken::m_tokensMtx;
 QTimer*                     TimeToken::m_updater = nullptr;
 QString                     TimeToken::m_current;
 QString                     TimeToken::m_prev;
@@ -341,9 +848,18 @@ QMutex                      TokenManager::m_usedTokensMtx;
 QMap<QString, QSet<IdType>> TokenManager::m_usedTokens;
 bool                        TokenManager::m_caseSensitive = false;
 
-QList<QPair<QString, QSharedPointer<ZeroStorageCaptcha>>> Cache::m_cache;
+std::list<Cache::Entry> Cache::m_cache;
+QHash<IdType, std::list<Cache::Entry>::iterator> Cache::m_index;
 QMutex Cache::m_cacheMtx;
 qsizetype Cache::m_capacity = 4096;
+qsizetype Cache::m_maxMemory = 0;
+qsizetype Cache::m_memoryUsage = 0;
+qsizetype Cache::m_reserved = 0;
+Cache::TokenBucket Cache::m_renderBucket {0, 0, 0, 0};
+Cache::TokenBucket Cache::m_composeBucket {500, 500, 500, 0};
+Cache::Stats Cache::m_stats;
+bool Cache::m_payloadCaching = false;
+bool Cache::m_spriteTier = false;
 int Cache::m_length = 5;
 int Cache::m_difficulty = 1;
 
@@ -352,19 +868,70 @@ void TimeToken::init()
     if (m_updater) return;
 
     m_updater = new QTimer;
-    m_current = ZeroStorageCaptchaService::random(TIME_TOKEN_SECRET_SIZE) + QString::number(QDateTime::currentSecsSinceEpoch());
+    {
+        QMutexLocker lock (&m_tokensMtx);
+        m_current = ZeroStorageCaptchaService::random(TIME_TOKEN_SECRET_SIZE) + QString::number(QDateTime::currentSecsSinceEpoch());
+    }
     m_updater->setInterval(TIMER_TO_CHANGE_TOKEN_MSECS);
-    QObject::connect (
-        m_updater, &QTimer::timeout,
-        [&]() {
-            m_prev = m_current;
-            m_current = ZeroStorageCaptchaService::random(TIME_TOKEN_SECRET_SIZE) + QString::number(QDateTime::currentSecsSinceEpoch());
-            TokenManager::removeAllTokensExceptPassed( currentToken(), prevToken() );
-        }
-    );
+    QObject::connect (m_updater, &QTimer::timeout, &TimeToken::rotate);
     m_updater->start();
 }
 
+void TimeToken::rotate()
+{
+    const QString next = ZeroStorageCaptchaService::random(TIME_TOKEN_SECRET_SIZE) + QString::number(QDateTime::currentSecsSinceEpoch());
+    QString prev;
+    {
+        QMutexLocker lock (&m_tokensMtx);
+        m_prev = m_current;
+        m_current = next;
+        prev = m_prev;
+    }
+    TokenManager::removeAllTokensExceptPassed( next, prev );
+}
+
+const QString TimeToken::currentToken()
+{
+    QMutexLocker lock (&m_tokensMtx);
+    return m_current;
+}
+
+const QString TimeToken::prevToken()
+{
+    QMutexLocker lock (&m_tokensMtx);
+    return m_prev;
+}
+
+QPair<QString, QString> TimeToken::tokens()
+{
+    QMutexLocker lock (&m_tokensMtx);
+    return { m_current, m_prev };
+}
+
+bool TimeToken::exists(const QString &some)
+{
+    QMutexLocker lock (&m_tokensMtx);
+    return m_current == some or m_prev == some;
+}
+
+void TimeToken::setAutoRotation(bool enabled)
+{
+    init();
+    if (enabled)
+    {
+        m_updater->start();
+    }
+    else
+    {
+        m_updater->stop();
+    }
+}
+
+int TimeToken::rotationInterval()
+{
+    return TIMER_TO_CHANGE_TOKEN_MSECS;
+}
+
 std::atomic<IdType> IdCounter::m_counter (0);
 
 IdType IdCounter::get()
@@ -384,12 +951,17 @@ QString TokenManager::get(const QString &captchaAnswer, IdType id, bool prevTime
         id = IdCounter::get();
     }
 
+    return get(captchaAnswer, id, prevTimeToken ? TimeToken::prevToken() : TimeToken::currentToken());
+}
+
+QString TokenManager::get(const QString &captchaAnswer, IdType id, const QString &timeToken)
+{
     // ANSWER + TIME_TOKEN + ID + SESSION_KEY
     // TIME_TOKEN - temporary marker for limiting captcha life circle
     // ID - IdType (size_t) validation key for concrete captcha
     // SESSION_KEY - random run-time session key for unique hash value
     const QString base = (m_caseSensitive ? captchaAnswer : captchaAnswer.toUpper()) +
-                         (prevTimeToken ? TimeToken::prevToken() : TimeToken::currentToken()) +
+                         timeToken +
                          QString::number(id);
 
     const QByteArray hash = QCryptographicHash::hash(base.toUtf8(), QCryptographicHash::Md5);
@@ -418,14 +990,16 @@ bool TokenManager::validateAnswer(const QString &answer, const QString &token)
         return false;
     }
 
+    // One snapshot: rotation between the checks must not file the id under another time key
+    const QPair<QString, QString> timeTokens = TimeToken::tokens();
     QString timeKey;
-    if (TokenManager::get(answer, id) == token)
+    if (TokenManager::get(answer, id, timeTokens.first) == token)
     {
-        timeKey = TimeToken::currentToken();
+        timeKey = timeTokens.first;
     }
-    else if (TokenManager::get(answer, id, true) == token)
+    else if (TokenManager::get(answer, id, timeTokens.second) == token)
     {
-        timeKey = TimeToken::prevToken();
+        timeKey = timeTokens.second;
     }
 
     if (timeKey.isEmpty())
@@ -443,7 +1017,19 @@ bool TokenManager::validateAnswer(const QString &answer, const QString &token)
     }
 
     m_usedTokens[timeKey].insert( id );
-    Cache::remove(token);
+
+    // Under flood one picture is recycled with many ids: once it is solved, the answer must not pass
+    // with its other tokens. Users who got the same picture have to request a new captcha.
+    const QVector<IdType> others = Cache::remove(id);
+    for (const QString& key: {timeTokens.first, timeTokens.second})
+    {
+        if (key.isEmpty() or others.isEmpty()) continue;
+        QSet<IdType>& used = m_usedTokens[key];
+        for (const IdType other: others)
+        {
+            used.insert(other);
+        }
+    }
 
     return true;
 }
@@ -469,6 +1055,23 @@ IdType TokenManager::bytesToNumber(const QByteArray &bytes)
     return number;
 }
 
+qsizetype TokenManager::usedTokensMemoryUsage()
+{
+    // QMap node (key, value, links) + time key characters + QSet buckets and nodes
+    constexpr qsizetype MAP_NODE_SIZE = sizeof(QString) + sizeof(QSet<IdType>) + 3 * sizeof(void*);
+    constexpr qsizetype SET_NODE_SIZE = sizeof(IdType) + 2 * sizeof(void*);
+
+    QMutexLocker lock (&m_usedTokensMtx);
+
+    qsizetype bytes = 0;
+    for (auto iter = m_usedTokens.constBegin(); iter != m_usedTokens.constEnd(); iter++)
+    {
+        bytes += MAP_NODE_SIZE + iter.key().capacity() * static_cast<qsizetype>(sizeof(QChar));
+        bytes += iter.value().capacity() * static_cast<qsizetype>(sizeof(void*)) + iter.value().size() * SET_NODE_SIZE;
+    }
+    return bytes;
+}
+
 void TokenManager::removeAllTokensExceptPassed(const QString& current, const QString& prev)
 {
     QMutexLocker lock (&m_usedTokensMtx);
@@ -489,21 +1092,32 @@ void TokenManager::removeAllTokensExceptPassed(const QString& current, const QSt
     }
 }
 
-QByteArray random(int length, bool onlyNumbers)
+#ifdef ZEROSTORAGECAPTCHA_DETERMINISTIC
+static QRandomGenerator seededGenerator;
+
+QRandomGenerator* generator()
 {
-    constexpr char randomtable[60] =
-         {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9',
-          'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j',
-          'k', 'l', 'm', 'n', 'k', 'p', 'q', 'r', 's', 't',
-          'u', 'v', 'w', 'x', 'y', 'z', 'A', 'B', 'C', 'D',
-          'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M', 'N',
-          'h', 'P', 'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X'};
+    return &seededGenerator;
+}
 
+void setSeed(quint32 seed)
+{
+    seededGenerator.seed(seed);
+}
+#else
+QRandomGenerator* generator()
+{
+    return QRandomGenerator::system();
+}
+#endif
+
+QByteArray random(int length, bool onlyNumbers, QRandomGenerator* source)
+{
     QByteArray random_value;
 
     while(random_value.size() < length)
     {
-        random_value += randomtable[ QRandomGenerator::system()->bounded (
+        random_value += randomtable[ source->bounded (
                                         onlyNumbers ? 0 : 1,
                                         onlyNumbers ? 9 : 59
                                      ) ];
@@ -512,6 +1126,678 @@ QByteArray random(int length, bool onlyNumbers)
     return random_value;
 }
 
+std::atomic<qint64> Clock::m_offset (0);
+std::atomic<bool> Clock::m_simulated (false);
+
+qint64 Clock::nsecs()
+{
+    return m_simulated ? m_offset.load() : QDeadlineTimer::current().deadlineNSecs() + m_offset;
+}
+
+void Clock::setSimulated(bool enabled)
+{
+    if (m_simulated == enabled) return;
+
+    // Offset becomes absolute time and back, so nsecs() does not jump
+    const qint64 wall = QDeadlineTimer::current().deadlineNSecs();
+    m_offset += enabled ? wall : -wall;
+    m_simulated = enabled;
+}
+
+bool ImageArena::m_enabled = false;
+bool ImageArena::m_hugePages = false;
+
+constexpr qsizetype ARENA_SLAB_SIZE = 2 * 1024 * 1024;
+constexpr qsizetype ARENA_CLASS_STEP = 16 * 1024;
+constexpr int ARENA_CLASSES = 32;              // slots up to 512 KiB
+constexpr qsizetype ARENA_SLOT_HEADER = 64;    // size class index, keeps pixels 64 bytes aligned
+
+struct ArenaState
+{
+    QMutex mutex;
+    std::vector<char*> freeSlots[ARENA_CLASSES];
+    qsizetype reserved = 0;
+    qsizetype used = 0;
+};
+
+static ArenaState& arenaState()
+{
+    // Never destroyed: cached pictures can be released during static destruction
+    static ArenaState* state = new ArenaState;
+    return *state;
+}
+
+static int arenaClass(qsizetype imageBytes)
+{
+    const qsizetype index = (imageBytes + ARENA_SLOT_HEADER + ARENA_CLASS_STEP - 1) / ARENA_CLASS_STEP - 1;
+    return index < ARENA_CLASSES ? static_cast<int>(index) : -1;
+}
+
+static char* allocateSlab(bool hugePages)
+{
+#ifdef Q_OS_LINUX
+    void* slab = MAP_FAILED;
+    if (hugePages)
+    {
+        slab = ::mmap(nullptr, ARENA_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (slab == MAP_FAILED)
+    {
+        slab = ::mmap(nullptr, ARENA_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED) return nullptr;
+        if (hugePages)
+        {
+            ::madvise(slab, ARENA_SLAB_SIZE, MADV_HUGEPAGE); // transparent huge pages when hugetlbfs is not reserved
+        }
+    }
+    return static_cast<char*>(slab);
+#else
+    Q_UNUSED(hugePages)
+    return static_cast<char*>(::malloc(ARENA_SLAB_SIZE));
+#endif
+}
+
+void ImageArena::setEnabled(bool enabled, bool hugePages)
+{
+    QMutexLocker lock (&arenaState().mutex);
+    m_enabled = enabled;
+    m_hugePages = hugePages;
+}
+
+QImage ImageArena::allocate(int width, int height)
+{
+    const qsizetype bytesPerLine = static_cast<qsizetype>(width) * 4;
+    const int index = arenaClass(bytesPerLine * height);
+    if (index < 0 or width <= 0 or height <= 0)
+    {
+        return QImage();
+    }
+
+    const qsizetype slotSize = (index + 1) * ARENA_CLASS_STEP;
+    ArenaState& state = arenaState();
+    QMutexLocker lock (&state.mutex);
+
+    std::vector<char*>& freeSlots = state.freeSlots[index];
+    if (freeSlots.empty())
+    {
+        char* slab = allocateSlab(m_hugePages);
+        if (not slab)
+        {
+            return QImage();
+        }
+        state.reserved += ARENA_SLAB_SIZE;
+        for (qsizetype offset = ARENA_SLAB_SIZE / slotSize * slotSize - slotSize; offset >= 0; offset -= slotSize)
+        {
+            freeSlots.push_back(slab + offset);
+        }
+    }
+
+    char* slot = freeSlots.back(); // last freed, still warm in cache
+    freeSlots.pop_back();
+    state.used += slotSize;
+    *reinterpret_cast<int*>(slot) = index;
+
+    return QImage(reinterpret_cast<uchar*>(slot + ARENA_SLOT_HEADER), width, height, static_cast<int>(bytesPerLine),
+                  QImage::Format_RGB32, &ImageArena::release, slot);
+}
+
+void ImageArena::release(void* slot)
+{
+    char* data = static_cast<char*>(slot);
+    const int index = *reinterpret_cast<int*>(data);
+
+    ArenaState& state = arenaState();
+    QMutexLocker lock (&state.mutex);
+    state.freeSlots[index].push_back(data);
+    state.used -= (index + 1) * ARENA_CLASS_STEP;
+}
+
+qsizetype ImageArena::slotSize(qsizetype imageBytes)
+{
+    const int index = arenaClass(imageBytes);
+    return index < 0 ? 0 : (index + 1) * ARENA_CLASS_STEP;
+}
+
+qsizetype ImageArena::reservedBytes()
+{
+    QMutexLocker lock (&arenaState().mutex);
+    return arenaState().reserved;
+}
+
+qsizetype ImageArena::usedBytes()
+{
+    QMutexLocker lock (&arenaState().mutex);
+    return arenaState().used;
+}
+
+// PNG for two-tone captcha pictures: gray (or RGB) 8 bit, one IDAT with a single fixed Huffman
+// deflate block. Matches are only distance 1 runs (zlib Z_RLE strategy): after Sub/Up filtering
+// the picture is mostly long runs of zeros, which cost ~21 bits per 258 bytes.
+
+constexpr int PNG_MAX_RUN = 258;
+
+struct PngTables
+{
+    quint32 crc[8][256];       // slicing-by-8
+    quint16 litCode[288];      // fixed Huffman literal/length codes, bit reversed
+    quint8 litBits[288];
+    quint16 lengthSymbol[259]; // match length -> symbol 257..285
+    quint8 lengthExtraBits[259];
+    quint16 lengthExtra[259];
+
+    PngTables()
+    {
+        for (quint32 n = 0; n < 256; ++n)
+        {
+            quint32 c = n;
+            for (int k = 0; k < 8; ++k)
+            {
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            crc[0][n] = c;
+        }
+        for (int n = 0; n < 256; ++n)
+        {
+            for (int t = 1; t < 8; ++t)
+            {
+                crc[t][n] = (crc[t - 1][n] >> 8) ^ crc[0][crc[t - 1][n] & 0xff];
+            }
+        }
+
+        for (int symbol = 0; symbol < 288; ++symbol)
+        {
+            quint32 code;
+            int bits;
+            if (symbol < 144)      { code = 0x30 + symbol;          bits = 8; }
+            else if (symbol < 256) { code = 0x190 + symbol - 144;   bits = 9; }
+            else if (symbol < 280) { code = symbol - 256;           bits = 7; }
+            else                   { code = 0xc0 + symbol - 280;    bits = 8; }
+
+            quint32 reversed = 0;
+            for (int i = 0; i < bits; ++i)
+            {
+                reversed |= ((code >> i) & 1) << (bits - 1 - i);
+            }
+            litCode[symbol] = static_cast<quint16>(reversed);
+            litBits[symbol] = static_cast<quint8>(bits);
+        }
+
+        static const quint16 base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                         35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+        static const quint8 extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                         3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+        for (int i = 0; i < 29; ++i)
+        {
+            const int last = i == 28 ? 258 : qMin(257, base[i] + (1 << extra[i]) - 1);
+            for (int length = base[i]; length <= last; ++length)
+            {
+                lengthSymbol[length] = static_cast<quint16>(257 + i);
+                lengthExtraBits[length] = extra[i];
+                lengthExtra[length] = static_cast<quint16>(length - base[i]);
+            }
+        }
+    }
+};
+
+static const PngTables& pngTables()
+{
+    static const PngTables tables;
+    return tables;
+}
+
+class BitWriter
+{
+public:
+    explicit BitWriter(uchar* out): m_out(out) {}
+
+    inline void put(quint32 value, int bits)
+    {
+        m_buffer |= static_cast<quint64>(value) << m_count;
+        m_count += bits;
+        while (m_count >= 8)
+        {
+            *m_out++ = static_cast<uchar>(m_buffer);
+            m_buffer >>= 8;
+            m_count -= 8;
+        }
+    }
+
+    uchar* finish()
+    {
+        if (m_count > 0)
+        {
+            *m_out++ = static_cast<uchar>(m_buffer);
+        }
+        m_buffer = 0;
+        m_count = 0;
+        return m_out;
+    }
+
+private:
+    uchar* m_out;
+    quint64 m_buffer = 0;
+    int m_count = 0;
+};
+
+static inline void putBigEndian(uchar* out, quint32 value)
+{
+    out[0] = static_cast<uchar>(value >> 24);
+    out[1] = static_cast<uchar>(value >> 16);
+    out[2] = static_cast<uchar>(value >> 8);
+    out[3] = static_cast<uchar>(value);
+}
+
+#ifdef ZEROSTORAGECAPTCHA_X86_SIMD
+
+static bool hasClmul()
+{
+    static const bool supported = __builtin_cpu_supports("pclmul") and __builtin_cpu_supports("sse4.1");
+    return supported;
+}
+
+static bool hasSsse3()
+{
+    static const bool supported = __builtin_cpu_supports("ssse3");
+    return supported;
+}
+
+__attribute__((target("pclmul")))
+static inline __m128i crc32Fold(__m128i x, __m128i k, __m128i next)
+{
+    const __m128i low = _mm_clmulepi64_si128(x, k, 0x00);
+    const __m128i high = _mm_clmulepi64_si128(x, k, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(high, low), next);
+}
+
+// Folds 4x128 bits per step with carry-less multiplication, then reduces with Barrett
+// (Intel "Fast CRC Computation Using PCLMULQDQ", constants for the reflected 0xedb88320).
+// size is a multiple of 16 and at least 64; crc is the inverted running value.
+__attribute__((target("pclmul,sse4.1")))
+static quint32 crc32Clmul(quint32 crc, const uchar* data, qsizetype size)
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    const auto load = [](const uchar* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); };
+
+    __m128i x1 = _mm_xor_si128(load(data), _mm_cvtsi32_si128(static_cast<int>(crc)));
+    __m128i x2 = load(data + 16);
+    __m128i x3 = load(data + 32);
+    __m128i x4 = load(data + 48);
+    data += 64;
+    size -= 64;
+
+    while (size >= 64)
+    {
+        x1 = crc32Fold(x1, k1k2, load(data));
+        x2 = crc32Fold(x2, k1k2, load(data + 16));
+        x3 = crc32Fold(x3, k1k2, load(data + 32));
+        x4 = crc32Fold(x4, k1k2, load(data + 48));
+        data += 64;
+        size -= 64;
+    }
+
+    x1 = crc32Fold(x1, k3k4, x2);
+    x1 = crc32Fold(x1, k3k4, x3);
+    x1 = crc32Fold(x1, k3k4, x4);
+    while (size >= 16)
+    {
+        x1 = crc32Fold(x1, k3k4, load(data));
+        data += 16;
+        size -= 16;
+    }
+
+    // 128 -> 64 bits
+    __m128i x0 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x0);
+    x0 = _mm_srli_si128(x1, 4);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, low32), k5k0, 0x00), x0);
+
+    // 64 -> 32 bits
+    x0 = _mm_and_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, low32), poly, 0x10), low32);
+    x0 = _mm_clmulepi64_si128(x0, poly, 0x00);
+    return static_cast<quint32>(_mm_extract_epi32(_mm_xor_si128(x1, x0), 1));
+}
+
+// 32 bytes per step: byte sums with PSADBW, position weighted sums with PMADDUBSW.
+// size is a multiple of 32; a and b are reduced modulo 65521 on return.
+__attribute__((target("ssse3")))
+static void adler32Ssse3(quint32& a, quint32& b, const uchar* data, qsizetype size)
+{
+    constexpr quint32 BASE = 65521;
+    constexpr qsizetype NMAX_BLOCKS = 5552 / 32;
+
+    const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+
+    qsizetype blocks = size / 32;
+    while (blocks > 0)
+    {
+        const qsizetype n = qMin(blocks, NMAX_BLOCKS);
+        blocks -= n;
+
+        __m128i prevSums = _mm_cvtsi32_si128(static_cast<int>(a * n)); // a of every block, times 32 below
+        __m128i sums = zero;
+        __m128i weighted = _mm_cvtsi32_si128(static_cast<int>(b));
+        for (qsizetype i = 0; i < n; ++i)
+        {
+            const __m128i bytes1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+            const __m128i bytes2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16));
+            prevSums = _mm_add_epi32(prevSums, sums);
+            sums = _mm_add_epi32(sums, _mm_add_epi32(_mm_sad_epu8(bytes1, zero), _mm_sad_epu8(bytes2, zero)));
+            weighted = _mm_add_epi32(weighted, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+            weighted = _mm_add_epi32(weighted, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+            data += 32;
+        }
+        weighted = _mm_add_epi32(weighted, _mm_slli_epi32(prevSums, 5));
+
+        sums = _mm_add_epi32(sums, _mm_shuffle_epi32(sums, _MM_SHUFFLE(1, 0, 3, 2)));
+        weighted = _mm_add_epi32(weighted, _mm_shuffle_epi32(weighted, _MM_SHUFFLE(2, 3, 0, 1)));
+        weighted = _mm_add_epi32(weighted, _mm_shuffle_epi32(weighted, _MM_SHUFFLE(1, 0, 3, 2)));
+        a = (a + static_cast<quint32>(_mm_cvtsi128_si32(sums))) % BASE;
+        b = static_cast<quint32>(_mm_cvtsi128_si32(weighted)) % BASE;
+    }
+}
+
+#endif // ZEROSTORAGECAPTCHA_X86_SIMD
+
+quint32 PngEncoder::crc32(quint32 crc, const uchar* data, qsizetype size)
+{
+    const PngTables& t = pngTables();
+    crc = ~crc;
+#ifdef ZEROSTORAGECAPTCHA_X86_SIMD
+    if (size >= 64 and hasClmul())
+    {
+        const qsizetype folded = size & ~qsizetype(15);
+        crc = crc32Clmul(crc, data, folded);
+        data += folded;
+        size -= folded;
+    }
+#endif
+    while (size >= 8)
+    {
+        const quint32 low = crc ^ (static_cast<quint32>(data[0]) | static_cast<quint32>(data[1]) << 8 |
+                                   static_cast<quint32>(data[2]) << 16 | static_cast<quint32>(data[3]) << 24);
+        crc = t.crc[7][low & 0xff] ^ t.crc[6][(low >> 8) & 0xff] ^ t.crc[5][(low >> 16) & 0xff] ^ t.crc[4][low >> 24] ^
+              t.crc[3][data[4]] ^ t.crc[2][data[5]] ^ t.crc[1][data[6]] ^ t.crc[0][data[7]];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0)
+    {
+        crc = t.crc[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+quint32 PngEncoder::adler32(quint32 adler, const uchar* data, qsizetype size)
+{
+    constexpr quint32 BASE = 65521;
+    constexpr qsizetype NMAX = 5552; // largest block without 32 bit overflow
+
+    quint32 a = adler & 0xffff;
+    quint32 b = adler >> 16;
+#ifdef ZEROSTORAGECAPTCHA_X86_SIMD
+    if (size >= 32 and hasSsse3())
+    {
+        const qsizetype vectorized = size & ~qsizetype(31);
+        adler32Ssse3(a, b, data, vectorized);
+        data += vectorized;
+        size -= vectorized;
+    }
+#endif
+    while (size > 0)
+    {
+        const qsizetype block = qMin(size, NMAX);
+        size -= block;
+        for (qsizetype i = 0; i < block; ++i)
+        {
+            a += data[i];
+            b += a;
+        }
+        data += block;
+        a %= BASE;
+        b %= BASE;
+    }
+    return b << 16 | a;
+}
+
+qsizetype PngEncoder::encode(const uchar* bits, int width, int height, qsizetype bytesPerLine, QByteArray& out)
+{
+    if (width <= 0 or height <= 0)
+    {
+        return 0;
+    }
+
+    // Gray when every pixel has R == G == B (antialiased black on white and back)
+    bool gray = true;
+    for (int y = 0; y < height and gray; ++y)
+    {
+        const quint32* row = reinterpret_cast<const quint32*>(bits + y * bytesPerLine);
+        quint32 mismatch = 0;
+        for (int x = 0; x < width; ++x)
+        {
+            const quint32 p = row[x];
+            mismatch |= ((p >> 16) ^ p) & 0xff;
+            mismatch |= ((p >> 8) ^ p) & 0xff;
+        }
+        gray = mismatch == 0;
+    }
+
+    const int bpp = gray ? 1 : 3;
+    const qsizetype lineSize = static_cast<qsizetype>(width) * bpp;
+    const qsizetype rawSize = (lineSize + 1) * height;
+
+    // Scanlines with heuristic filter (minimal sum of absolute signed bytes of None, Sub, Up)
+    static thread_local std::vector<uchar> scratch;
+    scratch.resize(static_cast<size_t>(rawSize + lineSize * 5));
+    uchar* raw = scratch.data();
+    uchar* current = raw + rawSize;
+    uchar* previous = current + lineSize;
+    uchar* candidates = previous + lineSize; // Sub, Up
+    std::fill(previous, previous + lineSize, 0);
+
+    for (int y = 0; y < height; ++y)
+    {
+        const quint32* row = reinterpret_cast<const quint32*>(bits + y * bytesPerLine);
+        if (gray)
+        {
+            for (int x = 0; x < width; ++x)
+            {
+                current[x] = static_cast<uchar>(row[x]);
+            }
+        }
+        else
+        {
+            for (int x = 0; x < width; ++x)
+            {
+                current[x * 3] = static_cast<uchar>(row[x] >> 16);
+                current[x * 3 + 1] = static_cast<uchar>(row[x] >> 8);
+                current[x * 3 + 2] = static_cast<uchar>(row[x]);
+            }
+        }
+
+        uchar* sub = candidates;
+        uchar* up = candidates + lineSize;
+        quint32 sumNone = 0;
+        quint32 sumSub = 0;
+        quint32 sumUp = 0;
+        for (qsizetype i = 0; i < lineSize; ++i)
+        {
+            sub[i] = static_cast<uchar>(current[i] - (i >= bpp ? current[i - bpp] : 0));
+            up[i] = static_cast<uchar>(current[i] - previous[i]);
+            sumNone += static_cast<quint32>(qAbs(static_cast<int>(static_cast<signed char>(current[i]))));
+            sumSub += static_cast<quint32>(qAbs(static_cast<int>(static_cast<signed char>(sub[i]))));
+            sumUp += static_cast<quint32>(qAbs(static_cast<int>(static_cast<signed char>(up[i]))));
+        }
+
+        uchar* line = raw + y * (lineSize + 1);
+        const uchar* chosen = current;
+        line[0] = 0;
+        if (sumSub < sumNone and sumSub <= sumUp)
+        {
+            line[0] = 1;
+            chosen = sub;
+        }
+        else if (sumUp < sumNone)
+        {
+            line[0] = 2;
+            chosen = up;
+        }
+        std::copy(chosen, chosen + lineSize, line + 1);
+        std::swap(current, previous);
+    }
+
+    // Worst case: every byte is a 9 bit literal
+    const qsizetype start = out.size();
+    const qsizetype idatCapacity = 2 + rawSize * 9 / 8 + 16 + 4;
+    out.resize(start + 8 + 25 + 8 + idatCapacity + 4 + 12);
+
+    uchar* const begin = reinterpret_cast<uchar*>(out.data()) + start;
+    uchar* p = begin;
+
+    static const uchar signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    std::copy(signature, signature + 8, p);
+    p += 8;
+
+    putBigEndian(p, 13);
+    std::copy("IHDR", "IHDR" + 4, p + 4);
+    putBigEndian(p + 8, static_cast<quint32>(width));
+    putBigEndian(p + 12, static_cast<quint32>(height));
+    p[16] = 8;            // bit depth
+    p[17] = gray ? 0 : 2; // color type
+    p[18] = 0;            // deflate
+    p[19] = 0;            // adaptive filtering
+    p[20] = 0;            // no interlace
+    putBigEndian(p + 21, crc32(0, p + 4, 17));
+    p += 25;
+
+    uchar* idat = p;
+    std::copy("IDAT", "IDAT" + 4, idat + 4);
+    p = idat + 8;
+    *p++ = 0x78; // zlib: deflate, 32K window, fastest
+    *p++ = 0x01;
+
+    const PngTables& t = pngTables();
+    BitWriter writer(p);
+    writer.put(0x3, 3); // BFINAL, fixed Huffman
+    for (qsizetype i = 0; i < rawSize;)
+    {
+        qsizetype run = 0;
+        if (i > 0)
+        {
+            const uchar value = raw[i - 1];
+            const qsizetype limit = qMin<qsizetype>(PNG_MAX_RUN, rawSize - i);
+            while (run < limit and raw[i + run] == value)
+            {
+                ++run;
+            }
+        }
+
+        if (run >= 3)
+        {
+            const quint16 symbol = t.lengthSymbol[run];
+            writer.put(t.litCode[symbol], t.litBits[symbol]);
+            writer.put(t.lengthExtra[run], t.lengthExtraBits[run]);
+            writer.put(0, 5); // distance 1
+            i += run;
+        }
+        else
+        {
+            writer.put(t.litCode[raw[i]], t.litBits[raw[i]]);
+            ++i;
+        }
+    }
+    writer.put(t.litCode[256], t.litBits[256]); // end of block
+    p = writer.finish();
+    putBigEndian(p, adler32(1, raw, rawSize));
+    p += 4;
+
+    const quint32 idatLength = static_cast<quint32>(p - idat - 8);
+    putBigEndian(idat, idatLength);
+    putBigEndian(p, crc32(0, idat + 4, idatLength + 4));
+    p += 4;
+
+    static const uchar iend[12] = {0, 0, 0, 0, 'I', 'E', 'N', 'D', 0xae, 0x42, 0x60, 0x82};
+    std::copy(iend, iend + 12, p);
+    p += 12;
+
+    const qsizetype written = p - begin;
+    out.resize(start + written);
+    return written;
+}
+
+qsizetype PngEncoder::encode(const QImage &image, QByteArray &out)
+{
+    if (image.format() != QImage::Format_RGB32 and image.format() != QImage::Format_ARGB32)
+    {
+        const QImage converted = image.convertToFormat(QImage::Format_RGB32);
+        return encode(converted.constBits(), converted.width(), converted.height(), converted.bytesPerLine(), out);
+    }
+    return encode(image.constBits(), image.width(), image.height(), image.bytesPerLine(), out);
+}
+
+QMutex GlyphLibrary::m_libraryMtx;
+QSharedPointer<const GlyphLibrary::Library> GlyphLibrary::m_library;
+
+void GlyphLibrary::build(int difficulty, int variants)
+{
+    QSharedPointer<Library> library (new Library);
+    library->difficulty = difficulty;
+
+    // Builder runs in its own thread: it must not draw from generator(), which is not thread-safe
+    // (and is reproducible from the seed) in ZEROSTORAGECAPTCHA_DETERMINISTIC builds
+#ifdef ZEROSTORAGECAPTCHA_DETERMINISTIC
+    QRandomGenerator source (static_cast<quint32>(difficulty) * 1000 + static_cast<quint32>(variants));
+#else
+    QRandomGenerator source = QRandomGenerator::securelySeeded();
+#endif
+
+    ZeroStorageCaptcha sample (difficulty, &source);
+    const QFontMetrics fm(sample.font());
+    for (const char symbol: randomtable)
+    {
+        if (library->glyphs.contains(QChar(symbol))) continue; // table has repeated symbols
+
+        QVector<Glyph>& glyphs = library->glyphs[QChar(symbol)];
+        glyphs.reserve(variants);
+        for (int i = 0; i < variants; ++i)
+        {
+            sample.setDifficulty(difficulty, &source); // random deform variant, as for a full render
+            glyphs.push_back(sample.renderGlyph(QChar(symbol), fm, &source));
+        }
+    }
+
+    QMutexLocker lock (&m_libraryMtx);
+    m_library = library;
+}
+
+void GlyphLibrary::buildInBackground(int difficulty, int variants)
+{
+    TimeToken::init(); // its QTimer must not be created in the builder thread
+
+    QThread* thread = QThread::create([difficulty, variants]() { build(difficulty, variants); });
+    QObject::connect(thread, &QThread::finished, thread, &QObject::deleteLater);
+    thread->start(QThread::LowPriority);
+}
+
+QSharedPointer<const GlyphLibrary::Library> GlyphLibrary::library()
+{
+    QMutexLocker lock (&m_libraryMtx);
+    return m_library;
+}
+
+bool GlyphLibrary::ready(int difficulty)
+{
+    QMutexLocker lock (&m_libraryMtx);
+    return not m_library.isNull() and m_library->difficulty == difficulty;
+}
+
 void Cache::setAnswerLength(int length)
 {
     if (length <= 0)
@@ -524,51 +1810,270 @@ void Cache::setAnswerLength(int length)
 
 QSharedPointer<ZeroStorageCaptcha> Cache::get()
 {
-    QMutexLocker lock (&m_cacheMtx);
-
-    for (auto iter = m_cache.begin(); iter != m_cache.end(); iter++)
+    bool compose = false;
+    bool reserved = false;
+    bool fitsMemory = true;
     {
-        if (not TimeToken::exists(iter->first))
+        QMutexLocker lock (&m_cacheMtx);
+        const QPair<QString, QString> timeTokens = TimeToken::tokens();
+
+        // Entries are ordered by last issue, so only the front one can be expired
+        if (not m_cache.empty() and m_cache.front().timeToken != timeTokens.first and m_cache.front().timeToken != timeTokens.second)
         {
-            iter->first = TimeToken::currentToken();
-            iter->second->dropToken();
-            return iter->second;
+            ++m_stats.reused;
+            return reissue(m_cache.begin(), timeTokens);
+        }
+
+        const bool renderAllowed = m_renderBucket.take();
+        compose = not renderAllowed and m_spriteTier and GlyphLibrary::ready(difficulty()) and m_composeBucket.take();
+        if (not renderAllowed and not compose)
+        {
+            if (not m_cache.empty())
+            {
+                // Render and compose budgets are exhausted (flood): least recently issued live captcha gets new id and token
+                ++m_stats.recycled;
+                return reissue(m_cache.begin(), timeTokens);
+            }
+
+            // Nothing to recycle (cache disabled or smaller than one entry): budget stays a hard ceiling
+            ++m_stats.rejected;
+            return QSharedPointer<ZeroStorageCaptcha>();
+        }
+
+        // Place is reserved before rendering, so concurrent renders do not overfill the cache.
+        // Cost of the new entry is not known yet, average one is expected.
+        const qsizetype entries = static_cast<qsizetype>(m_cache.size());
+        const qsizetype expectedCost = entries == 0 ? 0 : m_memoryUsage / entries;
+        fitsMemory = m_maxMemory <= 0 or m_memoryUsage + (m_reserved + 1) * expectedCost <= m_maxMemory;
+        reserved = entries + m_reserved < m_capacity and fitsMemory;
+        if (reserved)
+        {
+            ++m_reserved;
         }
     }
 
+    // Render and serialization run without the lock, other threads keep issuing cached captchas
     QSharedPointer<ZeroStorageCaptcha> captcha (new ZeroStorageCaptcha);
     captcha->generateAnswer(answerLength());
-    captcha->render();
+    const bool composed = compose and captcha->renderFromSprites();
+    if (not composed)
+    {
+        captcha->render();
+    }
+    if (reserved and m_payloadCaching)
+    {
+        captcha->preparePayloads(); // only for captchas which will be issued again
+    }
+
+    QMutexLocker lock (&m_cacheMtx);
 
-    if (m_cache.size() < m_capacity)
+    if (composed)
     {
-        m_cache.push_back( {TimeToken::currentToken(), captcha} );
+        ++m_stats.composed;
     }
-    else if (m_capacity > 0)
+    else
     {
-        qDebug() << __PRETTY_FUNCTION__ << "captcha cache is full. Maybe you should increase" << maxCapacity() << "by ZeroStorageCaptcha::setCacheMaxCapacity(qsizetype)";
+        ++m_stats.rendered;
     }
 
-    while (m_cache.size() > m_capacity)
+    if (reserved)
     {
-        m_cache.pop_front();
+        --m_reserved;
+        m_cache.push_back( {TimeToken::currentToken(), captcha, 0, {}, {}} );
+        captcha->m_token = issue(std::prev(m_cache.end())); // before the captcha is shared; accounts the entry
+        evict();
+    }
+    else if (m_capacity > 0 and not composed) // composed under flood, full cache is expected
+    {
+        if (fitsMemory)
+        {
+            qDebug() << __PRETTY_FUNCTION__ << "captcha cache is full. Maybe you should increase" << maxCapacity() << "by ZeroStorageCaptcha::setCacheMaxCapacity(qsizetype)";
+        }
+        else
+        {
+            qDebug() << __PRETTY_FUNCTION__ << "captcha cache memory is full. Maybe you should increase" << maxMemory() << "bytes by ZeroStorageCaptcha::setCacheMaxMemory(qsizetype)";
+        }
     }
 
     return captcha;
 }
 
-void Cache::remove(const QString &token)
+QVector<IdType> Cache::remove(IdType id)
 {
     QMutexLocker lock (&m_cacheMtx);
 
-    for (auto iter = m_cache.begin(); iter != m_cache.end(); iter++)
+    QVector<IdType> others;
+    const auto iter = m_index.constFind(id);
+    if (iter == m_index.constEnd())
+    {
+        return others;
+    }
+
+    const std::list<Entry>::iterator entry = iter.value();
+    others.reserve(entry->ids.size() + entry->prevIds.size() - 1);
+    for (const QVector<IdType>* ids: {&entry->ids, &entry->prevIds})
     {
-        if (iter->second->token() == token)
+        for (const IdType other: *ids)
         {
-            m_cache.erase(iter);
-            break;
+            if (other != id) others.push_back(other);
         }
     }
+    erase(entry);
+    return others;
+}
+
+qsizetype Cache::size()
+{
+    QMutexLocker lock (&m_cacheMtx);
+    return static_cast<qsizetype>(m_cache.size());
+}
+
+qsizetype Cache::memoryUsage()
+{
+    QMutexLocker lock (&m_cacheMtx);
+    return m_memoryUsage;
+}
+
+qsizetype Cache::entryCost(const Entry &entry)
+{
+    // list entry + QSharedPointer control block + time token copy (implicitly shared with TimeToken)
+    constexpr qsizetype ENTRY_OVERHEAD = sizeof(Entry) + 4 * sizeof(void*);
+    // ids vectors + their m_index nodes (key, iterator, next, hash)
+    constexpr qsizetype INDEX_NODE_SIZE = sizeof(IdType) + 3 * sizeof(void*);
+    qsizetype ids = (entry.ids.size() + entry.prevIds.size()) * INDEX_NODE_SIZE;
+    for (const QVector<IdType>* vector: {&entry.ids, &entry.prevIds})
+    {
+        if (vector->capacity() == 0) continue;
+        ids += vector->capacity() * static_cast<qsizetype>(sizeof(IdType)) + 2 * sizeof(void*);
+    }
+    return ENTRY_OVERHEAD + entry.captcha->memoryUsage() + ids;
+}
+
+void Cache::updateCost(Entry &entry)
+{
+    const qsizetype cost = entryCost(entry);
+    m_memoryUsage += cost - entry.cost;
+    entry.cost = cost;
+}
+
+Cache::Stats Cache::stats()
+{
+    QMutexLocker lock (&m_cacheMtx);
+    return m_stats;
+}
+
+void Cache::resetStats()
+{
+    QMutexLocker lock (&m_cacheMtx);
+    m_stats = Stats();
+}
+
+void Cache::setRenderBudget(qreal rendersPerSecond, int burst)
+{
+    QMutexLocker lock (&m_cacheMtx);
+    m_renderBucket.setRate(rendersPerSecond, burst);
+}
+
+void Cache::setComposeBudget(qreal composesPerSecond, int burst)
+{
+    QMutexLocker lock (&m_cacheMtx);
+    m_composeBucket.setRate(composesPerSecond, burst);
+}
+
+void Cache::TokenBucket::setRate(qreal perSecond, int burstSize)
+{
+    rate = perSecond > 0 ? perSecond : 0;
+    burst = burstSize > 0 ? burstSize : qMax<qreal>(1, rate);
+    tokens = burst;
+    lastNsecs = Clock::nsecs();
+}
+
+bool Cache::TokenBucket::take()
+{
+    if (rate <= 0) return true;
+
+    const qint64 now = Clock::nsecs();
+    tokens = qMin(burst, tokens + (now - lastNsecs) * rate / 1e9);
+    lastNsecs = now;
+
+    if (tokens < 1.0)
+    {
+        return false;
+    }
+    tokens -= 1.0;
+    return true;
+}
+
+QSharedPointer<ZeroStorageCaptcha> Cache::reissue(std::list<Entry>::iterator entry, const QPair<QString, QString>& timeTokens)
+{
+    advanceWindow(entry, timeTokens);
+
+    // Cached captcha is never modified after the first issue: every next one gets a copy
+    // (picture and payloads are implicitly shared) with its own token
+    QSharedPointer<ZeroStorageCaptcha> issued (new ZeroStorageCaptcha(*entry->captcha));
+    issued->m_token = issue(entry);
+
+    // Issued entry goes to the back, so the front is always the least recently issued one
+    m_cache.splice(m_cache.end(), m_cache, entry);
+    evict(); // recycled entries grow by an id per issue
+    return issued;
+}
+
+void Cache::advanceWindow(std::list<Entry>::iterator entry, const QPair<QString, QString>& timeTokens)
+{
+    if (entry->timeToken == timeTokens.first) return;
+
+    // Ids older than the previous window can not have valid tokens anymore
+    unindex(entry->prevIds);
+    entry->prevIds.clear();
+    if (entry->timeToken == timeTokens.second)
+    {
+        entry->prevIds.swap(entry->ids);
+    }
+    else
+    {
+        unindex(entry->ids);
+        entry->ids.clear();
+    }
+    entry->timeToken = timeTokens.first;
+}
+
+QString Cache::issue(std::list<Entry>::iterator entry)
+{
+    const IdType id = IdCounter::get();
+    entry->ids.push_back(id);
+    m_index.insert(id, entry);
+    updateCost(*entry); // ids can regrow
+    return TokenManager::get(entry->captcha->answer(), id, entry->timeToken); // same window as the entry
+}
+
+void Cache::evict()
+{
+    while (not m_cache.empty() and (static_cast<qsizetype>(m_cache.size()) > m_capacity or (m_maxMemory > 0 and m_memoryUsage > m_maxMemory)))
+    {
+        popFront();
+    }
+}
+
+void Cache::erase(std::list<Entry>::iterator entry)
+{
+    unindex(entry->ids);
+    unindex(entry->prevIds);
+    m_memoryUsage -= entry->cost;
+    m_cache.erase(entry);
+}
+
+void Cache::unindex(const QVector<IdType>& ids)
+{
+    for (const IdType id: ids)
+    {
+        m_index.remove(id);
+    }
+}
+
+void Cache::popFront()
+{
+    erase(m_cache.begin());
 }
 
 } // namespace ZeroStorageCaptchaService
@@ -26,13 +26,20 @@
 #define ZEROSTORAGECAPTCHA_H
 
 #include <QFont>
+#include <QFontMetrics>
 #include <QImage>
 #include <QString>
 #include <QTimer>
 #include <QMutex>
 #include <QSet>
 #include <QMap>
+#include <QPair>
+#include <QHash>
+#include <QVector>
 #include <QSharedPointer>
+#include <QRandomGenerator>
+
+#include <list>
 
 class ZeroStorageCaptcha;
 
@@ -40,7 +47,36 @@ namespace ZeroStorageCaptchaService {
 
 using IdType = size_t;
 
-QByteArray random(int length, bool onlyNumbers = false);
+QByteArray random(int length, bool onlyNumbers = false, QRandomGenerator* source = QRandomGenerator::system());
+
+// Source of randomness for captcha content (answer, variant, deform phase, overlay, colors).
+// Secrets (time tokens) always use QRandomGenerator::system().
+QRandomGenerator* generator();
+
+#ifdef ZEROSTORAGECAPTCHA_DETERMINISTIC
+// Test and bench builds only: the whole render pipeline becomes reproducible from the seed.
+// Never define ZEROSTORAGECAPTCHA_DETERMINISTIC in production, captchas become predictable.
+// Seeded generator is not thread-safe, render from one thread in this mode.
+void setSeed(quint32 seed);
+#endif
+
+class Clock
+{
+public:
+    Clock() = delete;
+
+    // Monotonic time for rate limits; advance() accelerates it for load simulation.
+    // Simulated mode freezes wall time, so time moves only by advance() and rate limits
+    // refill from simulated time alone (switch it before traffic starts).
+    static qint64 nsecs();
+    static void advance(qint64 nsecs) { m_offset += nsecs; }
+    static void setSimulated(bool enabled);
+    static bool simulated() { return m_simulated; }
+
+private:
+    static std::atomic<qint64> m_offset;
+    static std::atomic<bool> m_simulated;
+};
 
 class TimeToken
 {
@@ -48,11 +84,16 @@ public:
     TimeToken() = delete;
 
     static void init();
-    static const QString currentToken() { return m_current; }
-    static const QString prevToken()    { return m_prev; }
-    static bool exists(const QString& some) { return m_current == some or m_prev == some; }
+    static void rotate();
+    static void setAutoRotation(bool enabled = true); // false - rotate() is called by owner (simulated time)
+    static int rotationInterval(); // msecs
+    static const QString currentToken();
+    static const QString prevToken();
+    static QPair<QString, QString> tokens(); // current and previous from the same rotation
+    static bool exists(const QString& some);
 
 private:
+    static QMutex m_tokensMtx; // tokens are read from every thread which issues or validates captchas
     static QTimer* m_updater;
     static QString m_current;
     static QString m_prev;
@@ -69,9 +110,12 @@ private:
     static std::atomic<IdType> m_counter;
 };
 
+class Cache;
+
 class TokenManager
 {
     friend TimeToken;
+    friend Cache;
 
 public:
     TokenManager() = delete;
@@ -82,14 +126,76 @@ public:
     static IdType bytesToNumber(const QByteArray& bytes);
     static void setCaseSensitive(bool enabled = false) { m_caseSensitive = enabled; }
     static bool caseSensitive() { return m_caseSensitive; }
+    static qsizetype usedTokensMemoryUsage(); // approximate bytes held by the used (replay) ids set
 
 private:
+    static QString get(const QString& captchaAnswer, IdType id, const QString& timeToken);
     static void removeAllTokensExceptPassed(const QString& current, const QString& prev);
     static QMutex m_usedTokensMtx;
     static QMap<QString, QSet<IdType>> m_usedTokens;
     static bool m_caseSensitive;
 };
 
+class PngEncoder
+{
+public:
+    PngEncoder() = delete;
+
+    // Appends PNG to out (caller keeps the buffer to reuse its capacity), returns written bytes
+    static qsizetype encode(const QImage& image, QByteArray& out);
+    static qsizetype encode(const uchar* rgb32, int width, int height, qsizetype bytesPerLine, QByteArray& out);
+    static quint32 crc32(quint32 crc, const uchar* data, qsizetype size);
+    static quint32 adler32(quint32 adler, const uchar* data, qsizetype size);
+};
+
+class ImageArena
+{
+public:
+    ImageArena() = delete;
+
+    // Rendered pictures in fixed size class slots of 2 MiB slabs. Slabs are never returned to the system,
+    // freed slots are reused first, so RSS stays flat under cache churn.
+    static void setEnabled(bool enabled = false, bool hugePages = false);
+    static bool enabled() { return m_enabled; }
+    static QImage allocate(int width, int height); // Format_RGB32; null image when too large for any class
+    static qsizetype slotSize(qsizetype imageBytes); // 0 - does not fit any class
+    static qsizetype reservedBytes();
+    static qsizetype usedBytes();
+
+private:
+    static void release(void* slot);
+    static bool m_enabled;
+    static bool m_hugePages;
+};
+
+class GlyphLibrary
+{
+public:
+    GlyphLibrary() = delete;
+
+    // Pre-deformed, pre-rasterized character variants for the sprite render tier
+    struct Glyph
+    {
+        QImage mask; // Format_Alpha8 with the geometry of one character render()
+        int advance;
+    };
+
+    struct Library
+    {
+        int difficulty;
+        QHash<QChar, QVector<Glyph>> glyphs;
+    };
+
+    static void build(int difficulty, int variants = 16);
+    static void buildInBackground(int difficulty, int variants = 16);
+    static QSharedPointer<const Library> library(); // null until built
+    static bool ready(int difficulty);
+
+private:
+    static QMutex m_libraryMtx;
+    static QSharedPointer<const Library> m_library;
+};
+
 class Cache
 {
     friend TokenManager;
@@ -100,15 +206,77 @@ public:
     static int difficulty() { return m_difficulty; }
     static void setMaxCapacity(qsizetype value) { m_capacity = value; }
     static qsizetype maxCapacity() { return m_capacity; }
-    static qsizetype size() { return m_cache.size(); }
-    static QSharedPointer<ZeroStorageCaptcha> get();
+    static void setMaxMemory(qsizetype bytes) { m_maxMemory = bytes; } // 0 - without byte limit
+    static qsizetype maxMemory() { return m_maxMemory; }
+    static qsizetype memoryUsage();
+    static void setRenderBudget(qreal rendersPerSecond, int burst = 0); // 0 - without limit; burst 0 - one second of budget
+    static void setPayloadCaching(bool enabled = false) { m_payloadCaching = enabled; }
+    static bool payloadCaching() { return m_payloadCaching; }
+    static void setSpriteTier(bool enabled = false) { m_spriteTier = enabled; } // compose from glyphs when render budget is exhausted
+    static bool spriteTier() { return m_spriteTier; }
+    static void setComposeBudget(qreal composesPerSecond, int burst = 0); // sprite tier ceiling, then live captchas are recycled
+    static qreal composeBudget() { return m_composeBucket.rate; }
+    static qreal renderBudget() { return m_renderBucket.rate; }
+    static qsizetype size();
+    static QSharedPointer<ZeroStorageCaptcha> get(); // null when render budget is exhausted and cache is empty
+
+    struct Stats
+    {
+        qint64 reused = 0;   // expired captcha issued again
+        qint64 recycled = 0; // live captcha issued again, render (and compose) budget exhausted
+        qint64 rendered = 0;
+        qint64 composed = 0; // fresh captcha from sprite tier, render budget exhausted
+        qint64 rejected = 0; // null returned: budgets exhausted, nothing to recycle
+    };
+    static Stats stats();
+    static void resetStats();
 
 private:
-    static void remove(const QString& token);
-
-    static QList< QPair<QString /* time token */, QSharedPointer<ZeroStorageCaptcha>> > m_cache;
+    struct Entry
+    {
+        QString timeToken;
+        QSharedPointer<ZeroStorageCaptcha> captcha;
+        qsizetype cost; // accounted bytes, updated when the entry grows
+        // Ids issued in the window of timeToken and in the one before: only their tokens can be valid.
+        // Correct answer for any of them removes the entry.
+        QVector<IdType> ids;
+        QVector<IdType> prevIds;
+    };
+
+    struct TokenBucket
+    {
+        qreal rate;   // per second, 0 - without limit
+        qreal burst;
+        qreal tokens;
+        qint64 lastNsecs;
+
+        void setRate(qreal perSecond, int burstSize); // burstSize 0 - one second of rate
+        bool take();
+    };
+
+    static QVector<IdType> remove(IdType id); // returns other ids issued for the same picture
+    static qsizetype entryCost(const Entry& entry);
+    static void updateCost(Entry& entry);
+    static void popFront();
+    static void evict(); // down to capacity and memory limits
+    static void erase(std::list<Entry>::iterator entry);
+    static void unindex(const QVector<IdType>& ids);
+    static void advanceWindow(std::list<Entry>::iterator entry, const QPair<QString, QString>& timeTokens);
+    static QSharedPointer<ZeroStorageCaptcha> reissue(std::list<Entry>::iterator entry, const QPair<QString, QString>& timeTokens);
+    static QString issue(std::list<Entry>::iterator entry); // new id for the entry, returns its token
+
+    static std::list<Entry> m_cache; // ordered by last issue, O(1) move to the back
+    static QHash<IdType, std::list<Entry>::iterator> m_index; // issued id -> entry
     static QMutex m_cacheMtx;
     static qsizetype m_capacity;
+    static qsizetype m_maxMemory;
+    static qsizetype m_memoryUsage;
+    static qsizetype m_reserved; // places for captchas being rendered without the lock
+    static TokenBucket m_renderBucket;
+    static TokenBucket m_composeBucket;
+    static Stats m_stats;
+    static bool m_payloadCaching;
+    static bool m_spriteTier;
     static int m_length;
     static int m_difficulty;
 };
@@ -119,27 +287,63 @@ private:
 
 class ZeroStorageCaptcha
 {
-    friend ZeroStorageCaptchaService::Cache; // for dropToken()
+    friend ZeroStorageCaptchaService::Cache; // for m_token
+    friend ZeroStorageCaptchaService::GlyphLibrary; // for renderGlyph() and sample with own generator
 public:
     ZeroStorageCaptcha();
     ZeroStorageCaptcha(const QString& answer, int difficulty = ZeroStorageCaptchaService::Cache::difficulty());
-    static QSharedPointer<ZeroStorageCaptcha> cached();
+    static QSharedPointer<ZeroStorageCaptcha> cached(); // null when render budget is exhausted and cache is empty
     static bool validate(const QString& answer, const QString& token);
     static void setCacheMaxCapacity(qsizetype value);
     static qsizetype cacheMaxCapacity();
     static qsizetype cacheSize();
+    static void setCacheMaxMemory(qsizetype bytes);
+    static qsizetype cacheMaxMemory();
+    static qsizetype cacheMemoryUsage();
+    static qsizetype usedTokensMemoryUsage();
+    static void setCacheRenderBudget(qreal rendersPerSecond, int burst = 0);
+    static qreal cacheRenderBudget();
+    static void setCachePayloads(bool enabled = false); // keep PNG, data URI and JSON with every cached captcha
+    static bool cachePayloads();
+    static void setImageArena(bool enabled = false, bool hugePages = false); // slab storage for pictures
+    static bool imageArena();
+    static void setSpriteTier(bool enabled = false, int variants = 16, qreal composesPerSecond = 500); // builds glyph library in background
+    static bool spriteTier();
     static void setDefaultAnswerLength(int length);
     static int defaultAnswerLength();
     static void setDefaultDifficulty(int difficulty);
     static int defaultDifficulty();
     static void setNumbersOnlyMode(bool enabled = false) { m_onlyNumbers = enabled; }
     static bool numbersOnlyMode() { return m_onlyNumbers; }
+    static void setFastOverlayMode(bool enabled = false) { m_fastOverlay = enabled; } // lines, ellipses and noise without QPainter
+    static bool fastOverlayMode() { return m_fastOverlay; }
+    static void setBuiltinPngEncoder(bool enabled = false) { m_builtinPng = enabled; } // picturePng() without Qt image plugins
+    static bool builtinPngEncoder() { return m_builtinPng; }
     static void setCaseSensitive(bool enabled = false);
     static bool caseSensitive();
 
     QString answer() const        { return m_captchaText; }
     QString token() const;
+    // JSON response {"image":"data:image/png;base64,...","token":"..."} split around the token:
+    // prefix + dataUri + middle + token + tail, ready for a gathered write without per-request encoding.
+    // dataUri is shared with pictureDataUri(), the other parts are constants.
+    struct JsonPayload
+    {
+        QByteArray prefix;
+        QByteArray dataUri;
+        QByteArray middle;
+        QByteArray tail;
+
+        qsizetype size() const { return prefix.size() + dataUri.size() + middle.size() + tail.size(); } // without token
+    };
+
     QByteArray picturePng() const;
+    QByteArray pictureDataUri() const;
+    JsonPayload jsonPayload() const;
+    QByteArray json() const;
+    qsizetype json(QByteArray& out) const; // appends to out (caller keeps the buffer to reuse its capacity), returns written bytes
+    void preparePayloads(); // cache serialized picture until next render()
+    qsizetype memoryUsage() const; // approximate heap and object bytes owned by this captcha
 
     QImage qimage() const         { return m_captchaImage; }
     QFont font() const            { return m_font; }
@@ -175,11 +379,19 @@ public:
     void setAnswer(const QString& answer);
     void generateAnswer(int length = 5);
     void render();
+    bool renderFromSprites(); // false when glyph library is not built or lacks answer characters
 
 private:
-    void dropToken() { m_token.clear(); } // for Cache
-    void init();
+    ZeroStorageCaptcha(int difficulty, QRandomGenerator* source); // for GlyphLibrary
+    void init(QRandomGenerator* source = ZeroStorageCaptchaService::generator());
+    void setDifficulty(int val, QRandomGenerator* source);
+    void renderOverlayFast();
+    void allocateImage(int width, int height);
+    void dropPayloads();
+    ZeroStorageCaptchaService::GlyphLibrary::Glyph renderGlyph(QChar symbol, const QFontMetrics& fm, QRandomGenerator* source) const;
     static bool m_onlyNumbers;
+    static bool m_fastOverlay;
+    static bool m_builtinPng;
 
     qreal m_hmod1;
     qreal m_hmod2;
@@ -189,6 +401,7 @@ private:
 
     QFont m_font;
     QImage m_captchaImage;
+    bool m_arenaImage = false; // picture lives in an ImageArena slot
     QString m_captchaText = "empty";
     QColor m_fontColor;
     QColor m_backColor;
@@ -205,6 +418,8 @@ private:
     int m_noisePointSize;
 
     mutable QString m_token;
+    QByteArray m_png;
+    QByteArray m_dataUri;
 };
 
 #endif // ZEROSTORAGECAPTCHA_H 